@@ -58,22 +58,176 @@
 #define WEATHER_TEMP_MARGIN_BOTTOM 0
 #define WEATHER_TEMP_MARGIN_LEFT 5
 #define WEATHER_UPDATE_INTERVAL 300000 // 5 minutes in milliseconds
-#define WEATHER_EMOJI_COMMAND                                                  \
-  "curl -s wttr.in/ballia?format=3 | awk '{print $2}'"
-#define WEATHER_TEMP_COMMAND                                                   \
-  "curl -s wttr.in/ballia?format=3 | awk '{print $3}' | cut -d \"+\" -f2"
+// One request feeds both weather labels, e.g. "Ballia: ⛅️  +31°C"
+#define WEATHER_COMMAND "curl -s wttr.in/ballia?format=3"
+#define WEATHER_EMOJI_EXTRACT {.kind = EXTRACT_FIELD, .field = 2}
+#define WEATHER_TEMP_EXTRACT                                                   \
+  {.kind = EXTRACT_REGEX, .pattern = "(-?[0-9]+°[CF])"}
+// Shown as a tooltip when hovering the weather, fetched only on hover
+#define WEATHER_DETAIL_COMMAND                                                 \
+  "curl -s 'wttr.in/ballia?format=%C,+%t+(feels+like+%f),+wind+%w,+humidity+%h'"
+
+// Agenda under the weather: upcoming events from local iCalendar files,
+// ':'-separated (NULL to hide). Each file is indexed once under
+// $XDG_CACHE_HOME, recurrences included, and only re-read when it changes.
+#define AGENDA_FILES NULL // e.g. "~/.local/share/calendars/work.ics"
+#define AGENDA_DAYS 7       // How far ahead events are shown
+#define AGENDA_MAX_EVENTS 3 // Events shown at most
+#define AGENDA_FONT "Computerfont"
+#define AGENDA_TEXT_SIZE 14
+
+// Draw the date and weather dashboard inside the wallpaper surface instead
+// of a separate full-screen "day-text" layer surface (saves a buffer and a
+// composite per output)
+#define DASHBOARD_IN_BACKGROUND 0
+
+// Resolve and rasterize the configured fonts on a worker thread at startup;
+// the text windows wait up to FONT_WARMUP_TIMEOUT milliseconds for it
+#define FONT_WARMUP 1
+#define FONT_WARMUP_TIMEOUT 500
+
+// Keep decoded, output-scaled wallpapers under $XDG_CACHE_HOME so later
+// starts can map them instead of decoding the image again. Entries for
+// deleted images are dropped, then the least recently shown ones once the
+// cache grows past WALLPAPER_CACHE_MAX_MB.
+#define WALLPAPER_CACHE 1
+#define WALLPAPER_CACHE_MAX_MB 512
+
+// Derive the bar background and border colours from the wallpaper on screen
+// instead of BAR_BACKGROUND_COLOR and BAR_BORDER_COLOR. The palette is
+// computed on a worker thread and remembered per image.
+#define BAR_AUTO_THEME 0
+#define BAR_AUTO_THEME_DARK_TEXT "#1D2021"  // Label colour on light colours
+#define BAR_AUTO_THEME_LIGHT_TEXT "#EBDBB2" // Label colour on dark colours
+
+// Blur the wallpaper under the bar once per wallpaper and output size and
+// use it as the bar background, instead of a per-frame compositor blur
+#define BAR_FROSTED 0
+#define BAR_FROSTED_RADIUS 16 // Blur radius in logical pixels
+#define BAR_FROSTED_TINT 0.35 // Opacity of the bar colour over the blur
+
+// Low-memory mode (also --low-memory): fewer malloc arenas, small worker
+// stacks, decoded wallpapers only kept as mapped cache files, one prefetched
+// slide, and the heap trimmed after bursts of allocation
+#define LOW_MEMORY_MODE 0
+#define LOW_MEMORY_ARENAS 2                // malloc arenas (M_ARENA_MAX)
+#define LOW_MEMORY_STACK_SIZE (256 * 1024) // Bytes per worker stack
+
+// Wallpaper slideshow configuration (--background-dir/--background-playlist)
+#define SLIDESHOW_INTERVAL 600 // Seconds between wallpapers
+#define SLIDESHOW_MAX_FRAMES 2 // Decoded wallpapers in memory, including the
+                               // one on screen (at least 2)
+
+// Bar item width policies. Anything but BAR_WIDTH_NATURAL keeps the label
+// from resizing the whole bar every time its text changes width.
+typedef enum {
+  BAR_WIDTH_NATURAL = 0, // Follow the text width (default)
+  BAR_WIDTH_FIXED,       // Always width_chars wide, ellipsized beyond that
+                         // (natural without width_chars)
+  BAR_WIDTH_GROW_ONLY,   // Grow to the widest text seen, never shrink
+  BAR_WIDTH_MAX,         // Grow-only up to width_chars, ellipsized beyond that
+} BarWidthPolicy;
+
+// In-process extraction of a value from command output, so one command can
+// feed several widgets without piping through awk/cut
+typedef enum {
+  EXTRACT_NONE = 0, // Use the whole output
+  EXTRACT_FIELD,    // Field number `field` (1-based), like awk or cut
+  EXTRACT_REGEX,    // First capture group of `pattern` (or the whole match)
+  EXTRACT_TEMPLATE, // `pattern` with {N} replaced by whitespace field N
+                    // and {0} by the whole output
+} ExtractKind;
+
+typedef struct {
+  ExtractKind kind;
+  const char *pattern;   // Regex for EXTRACT_REGEX, text for EXTRACT_TEMPLATE
+  const char *delimiter; // Field separator; NULL splits on runs of whitespace
+  int field;             // Field number for EXTRACT_FIELD
+} Extractor;
+
+// Bar item scheduling classes, applied to the item's worker thread and
+// inherited by every command it runs
+typedef enum {
+  BAR_PRIORITY_NORMAL = 0, // Default CPU and I/O scheduling
+  BAR_PRIORITY_IDLE_IO,    // Idle I/O class only
+  BAR_PRIORITY_IDLE,       // SCHED_IDLE and idle I/O class
+} BarPriority;
+
+// Share of one CPU (in percent) a bar item's command may use on average
+// before its interval is stretched (0 disables). Items can override it.
+#define MODULE_CPU_BUDGET 0
+#define MODULE_MAX_STRETCH 8 // Longest stretched interval, as a multiple of
+                             // the configured one
+
+// Scheduling profiles: bar module, weather and date intervals are multiplied
+// on battery and while the system is under CPU or memory pressure (PSI)
+#define PROFILE_CHECK_INTERVAL 5  // Seconds between checks (0 to disable)
+#define BATTERY_INTERVAL_SCALE 2  // Interval multiplier on battery
+#define PRESSURE_INTERVAL_SCALE 4 // Interval multiplier under pressure
+#define PRESSURE_HIGH 20.0 // PSI "some avg10" percent entering the profile
+#define PRESSURE_LOW 5.0   // PSI "some avg10" percent leaving it
+
+// Bar items with shell set keep one /bin/sh per worker and feed it their
+// command on each run; a command still running after this many milliseconds
+// gets the shell killed and restarted
+#define SHELL_COMMAND_TIMEOUT 10000
+
+// Modules running the same command with the same nice, priority and shell
+// settings share one execution and reuse its output for up to this many
+// milliseconds (capped at half the module's interval)
+#define COMMAND_CACHE_TTL 1000
+
+// How long the output of a bar item's detail_command is reused as its tooltip
+#define DETAIL_CACHE_TTL 10000 // 10 seconds in milliseconds
+
+// Native "<mpris>" bar item: now playing from MPRIS media players, updated
+// from D-Bus signals instead of polling playerctl
+#define MPRIS_PLAYING_ICON "▶"
+#define MPRIS_PAUSED_ICON "⏸"
+
+// Native "<network>" bar item: interfaces, addresses and throughput from
+// rtnetlink events, with byte counters sampled every NETWORK_SAMPLE_INTERVAL
+#define NETWORK_SAMPLE_INTERVAL 2000 // 2 seconds in milliseconds
+#define NETWORK_DOWN_TEXT "offline"
+
+// Colours for ANSI SGR codes 30-37/90-97 (and 40-47/100-107) in module
+// output; the rest of the 256-colour and true-colour codes are computed
+static const char *ANSI_COLORS[16] = {
+    "#282828", "#CC241D", "#98971A", "#D79921", "#458588", "#B16286",
+    "#689D6A", "#A89984", "#928374", "#FB4934", "#B8BB26", "#FABD2F",
+    "#83A598", "#D3869B", "#8EC07C", "#EBDBB2"};
 
 // Bar items configuration
 typedef struct {
   const char *command; // Shell command to execute, or "<separator>" for spacer
   int interval;        // Update interval in milliseconds (0 for separator)
+  int signal;          // Refresh on SIGRTMIN+signal (0 to disable)
+  BarWidthPolicy width_policy; // How the label width follows its text
+  int width_chars;             // Limit for BAR_WIDTH_FIXED and BAR_WIDTH_MAX
+  int nice;                    // Nice level for the command (0 to keep)
+  BarPriority priority;        // CPU/I/O scheduling class
+  int cpu_budget; // CPU budget in percent (0 for MODULE_CPU_BUDGET, -1 for
+                  // none)
+  Extractor extract; // Value to show from the output; items with the same
+                     // command share one execution (see COMMAND_CACHE_TTL)
+  const char *detail_command; // Tooltip command, run only on hover
+  // Event triggers; with either set, interval only acts as a safety poll
+  // (0 to disable). A "<file>PATH" command reads PATH without spawning a
+  // shell and watches it unless watch says otherwise.
+  const char *watch;  // ':'-separated paths re-running the item on change
+  const char *uevent; // Kernel uevent subsystem, e.g. "power_supply"
+  int shell;          // Run in a persistent shell instead of a new one
 } BarItem;
 
 // Define the items array
-static const BarItem BAR_ITEMS[] = {{"hyprland-workspaces", 300},
-                                    {"hyprland-window-title", 300},
-                                    {"<separator>", 0},
-                                    {"status", 500}};
+static const BarItem BAR_ITEMS[] = {
+    {.command = "hyprland-workspaces", .interval = 300},
+    {.command = "hyprland-window-title",
+     .interval = 300,
+     .width_policy = BAR_WIDTH_MAX,
+     .width_chars = 80},
+    {.command = "<separator>", .interval = 0},
+    {.command = "status", .interval = 500}};
 
 #define BAR_ITEMS_COUNT (sizeof(BAR_ITEMS) / sizeof(BAR_ITEMS[0]))
 
@@ -1,16 +1,119 @@
+#define _GNU_SOURCE
 #include "config.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <gtk4-layer-shell/gtk4-layer-shell.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <malloc.h>
+#include <net/if.h>
+#include <pango/pangocairo.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+// Latency histogram with power-of-two microsecond buckets
+#define LATENCY_BUCKETS 24 // Last bucket holds everything above ~8 seconds
+
+typedef struct {
+  guint64 count;
+  guint64 total_us;
+  guint64 max_us;
+  guint64 buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Resource usage of the commands run for a module, from wait4()
+typedef struct {
+  guint64 runs;
+  guint64 cache_hits; // Results shared from another run of the same command
+  guint64 failures; // Non-zero exit status or killed by a signal
+  gint64 user_us;   // User CPU time
+  gint64 sys_us;    // System CPU time
+  long max_rss_kb;  // Largest peak RSS of a single run
+  int last_status;  // Raw wait status of the last run
+} CommandUsage;
+
+// Per-module update latency, measured from the moment new output is
+// available in the worker thread
+typedef struct {
+  const char *name;
+  LatencyHistogram queue;   // Until the idle callback runs
+  LatencyHistogram paint;   // Until the frame containing it is painted
+  LatencyHistogram present; // Until that frame is presented
+  GMutex usage_lock;        // Guards usage and stretched_interval
+  CommandUsage usage;       // Totals over all runs
+  int stretched_interval;   // Interval in ms after CPU budgeting (0 if not)
+} ModuleStats;
+
+// Per-window frame timing
+typedef struct {
+  const char *name;
+  LatencyHistogram layout;  // Frame start to end of layout
+  LatencyHistogram paint;   // End of layout to end of paint
+  LatencyHistogram present; // End of paint to presentation
+  gint64 frame_start_time;
+  gint64 layout_done_time;
+  GArray *pending;  // Updates applied but not yet painted
+  GArray *awaiting; // Painted frames waiting for presentation feedback
+  gint64 first_paint_time; // End of the first painted frame
+} WindowStats;
+
+// Update or frame tracked through the frame clock
+typedef struct {
+  ModuleStats *module; // NULL for the frame itself
+  gint64 ready_time;
+  gint64 frame_counter;
+  gint64 painted_time;
+} PendingFrameUpdate;
+
+static ModuleStats bar_module_stats[BAR_ITEMS_COUNT];
+static ModuleStats weather_module_stats = {.name = "weather"};
+static ModuleStats date_module_stats = {.name = "date"};
+static WindowStats background_window_stats = {.name = "background"};
+static WindowStats day_text_window_stats = {.name = "day-text"};
+static WindowStats bar_window_stats = {.name = "bar"};
+static gboolean print_stats_on_exit = FALSE;
+static gint64 startup_time = 0; // Monotonic time main() started
+
+// Font warm-up worker (FONT_WARMUP)
+typedef struct {
+  GThread *thread;
+  GMutex mutex;
+  GCond cond;
+  gboolean done;
+  gint64 duration; // Time spent by the worker, in microseconds
+  gint64 waited;   // Time activate blocked waiting for it
+  gint64 deadline; // End of the wait, shared by every caller (0 until set)
+} FontWarmupData;
+
+static FontWarmupData font_warmup = {0};
+
 // Structure to hold update data for main thread
 typedef struct {
   GtkWidget *widget;
+  const char *id;
   gchar *new_output;
+  ModuleStats *stats;
+  gint64 ready_time; // When the worker had the new output
 } UpdateData;
 
 // Structure to hold weather update data for main thread
@@ -19,6 +122,7 @@ typedef struct {
   GtkWidget *temp_widget;
   gchar *new_emoji;
   gchar *new_temp;
+  gint64 ready_time;
 } WeatherUpdateData;
 
 // Structure to hold date update data for main thread
@@ -29,24 +133,166 @@ typedef struct {
   gchar *new_day;
   gchar *new_month;
   gchar *new_day_number;
+  GtkWidget *agenda_widget;
+  gchar *new_agenda;
+  gint64 ready_time;
 } DateUpdateData;
 
+// Long-lived /bin/sh that runs a module's command on every poll. Only the
+// module's worker uses it, so it needs no locking.
+typedef struct {
+  pid_t pid;          // 0 while not running
+  int fd;             // Socket connected to the shell's stdin and stdout
+  guint64 sequence;   // Numbers the end-of-output delimiters
+  GString *buffer;    // Output read past the last delimiter
+  gint64 user_ticks;  // Shell and reaped children user time at the last run
+  gint64 sys_ticks;   // Same for system time
+  guint restarts;     // Times the shell died or timed out
+} ShellCoprocess;
+
 // Structure to hold item widget and update info
 typedef struct {
   GtkWidget *widget;
+  gchar *id; // Module id used outside the UI, e.g. "bar.2"
   const char *command;
   int interval;
-  GThread *thread;         // Worker thread for this module
-  gboolean should_stop;    // Flag to stop the thread
-  gboolean thread_running; // Flag to track if thread is active
-  GMutex mutex;            // Mutex for thread-safe access
-  GCond cond;              // Condition variable for interruptible sleep
-  gchar *previous_output;  // Previous output for change detection
+  int signal;                  // Real-time signal offset (0 if none)
+  BarWidthPolicy width_policy; // How the label width follows its text
+  int width_chars;             // Width limit in characters
+  int width_char_px;           // Character width the size request is based on
+  int width_px;                // Current label size request in pixels
+  int nice;                    // Nice level applied to the worker thread
+  BarPriority priority;        // Scheduling class applied to the worker thread
+  int cpu_budget;              // Allowed CPU share in percent, <= 0 for none
+  const Extractor *extract;    // Value taken from the command output
+  int effective_interval;      // Interval after CPU budgeting, in ms
+  gint64 cpu_average_us;       // Smoothed CPU time per run
+  GThread *thread;             // Worker thread for this module
+  gboolean should_stop;        // Flag to stop the thread
+  gboolean thread_running;     // Flag to track if thread is active
+  gboolean refresh_requested;  // Set when a refresh signal arrives
+  GMutex mutex;                // Mutex for thread-safe access
+  GCond cond;                  // Condition variable for interruptible sleep
+  gchar *previous_output;      // Previous output for change detection
+  ModuleStats *stats;          // Update latency statistics
+  ShellCoprocess *shell;       // Persistent shell, NULL to spawn per run
 } BarItemData;
 
 static gchar *background_image_path = NULL;
+static gboolean headless_mode = FALSE;
+static gboolean low_memory_mode = LOW_MEMORY_MODE;
+static gboolean font_warmup_enabled = FONT_WARMUP;
+static gboolean serve_mode = FALSE;   // Publish module values on a socket
+static gboolean connect_mode = FALSE; // Show values from a --serve backend
+static gboolean engine_only = FALSE;  // No windows (--headless or --serve)
+static gchar *socket_path = NULL;
 static BarItemData *bar_items_data = NULL;
 
+// Approximate character width in pixels, keyed by font description
+static GHashTable *char_width_cache = NULL;
+
+// Module output with ANSI escapes parsed out, keyed by the raw output
+typedef struct {
+  gchar *text;          // Valid UTF-8 without escape sequences
+  PangoAttrList *attrs; // NULL if the output sets no attributes
+} AnsiText;
+
+static GHashTable *ansi_text_cache = NULL;
+
+#define ANSI_TEXT_CACHE_SIZE 64 // Outputs kept before the cache is reset
+
+// Last result of a command, shared by every module that runs it
+typedef struct {
+  gchar *output;    // NULL if the command failed
+  gint64 finished;  // Monotonic time the last run completed
+  gboolean running; // A worker is executing it right now
+} CommandCacheEntry;
+
+static GHashTable *command_cache = NULL; // Scheduling + command -> entry
+static GMutex command_cache_lock;
+static GCond command_cache_cond; // Broadcast whenever a run completes
+#define COMMAND_CACHE_WAIT 2000 // Milliseconds to wait on another's run
+
+// Compiled extractor regexes by pattern (NULL value if it failed to compile)
+static GHashTable *extract_regex_cache = NULL;
+static GMutex extract_regex_lock;
+
+static const Extractor weather_emoji_extract = WEATHER_EMOJI_EXTRACT;
+static const Extractor weather_temp_extract = WEATHER_TEMP_EXTRACT;
+
+// Self-pipe used to forward refresh signals to the main loop
+static int refresh_signal_pipe[2] = {-1, -1};
+static guint refresh_signal_source_id = 0;
+
+// Bar items with a "<file>PATH" command read PATH directly
+#define MODULE_FILE_PREFIX "<file>"
+
+// inotify watch that refreshes a bar item. Files are watched through their
+// directory so editors and scripts that replace them atomically still count.
+typedef struct {
+  int wd;
+  gchar *name; // Entry in the watched directory, NULL for the directory
+  BarItemData *item_data;
+} ModuleWatch;
+
+static int inotify_fd = -1;
+static guint inotify_source_id = 0;
+static GArray *module_watches = NULL;
+static int uevent_fd = -1;
+static guint uevent_source_id = 0;
+
+// Native "<mpris>" bar item, driven by D-Bus signals on the main loop
+#define MODULE_MPRIS "<mpris>"
+#define MPRIS_PREFIX "org.mpris.MediaPlayer2."
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define MPRIS_PLAYER_INTERFACE "org.mpris.MediaPlayer2.Player"
+
+typedef struct {
+  gchar *bus_name; // Well-known name, e.g. org.mpris.MediaPlayer2.mpv
+  gchar *owner;    // Unique name PropertiesChanged is sent from
+  gchar *status;   // PlaybackStatus
+  gchar *title;
+  gchar *artist;
+} MprisPlayer;
+
+typedef struct {
+  GDBusConnection *connection;
+  GCancellable *cancellable;
+  GHashTable *players; // Bus name -> MprisPlayer
+  guint properties_id;
+  guint owner_id;
+} MprisData;
+
+static MprisData *mpris_data = NULL;
+
+// Native "<network>" bar item: link and address state from rtnetlink,
+// throughput from the sysfs counters
+#define MODULE_NETWORK "<network>"
+
+typedef struct {
+  gchar *name;
+  gboolean up;         // IFF_UP and IFF_RUNNING
+  gboolean loopback;
+  GPtrArray *ipv4;     // Addresses as text
+  GPtrArray *ipv6;     // Global addresses as text
+  guint64 rx_bytes;    // Counters at the last sample
+  guint64 tx_bytes;
+  double rx_rate;      // Bytes per second over the last sample
+  double tx_rate;
+} NetInterface;
+
+typedef struct {
+  int fd;
+  guint source_id;
+  guint timer_id;
+  guint32 sequence;
+  gboolean addresses_requested; // Address dump follows the link dump
+  gint64 sample_time;           // When the counters were last read
+  GHashTable *interfaces;       // ifindex -> NetInterface
+} NetworkData;
+
+static NetworkData *network_data = NULL;
+
 // Structure to hold weather widget and update info
 typedef struct {
   GtkWidget *emoji_widget;
@@ -67,6 +313,7 @@ typedef struct {
   GtkWidget *day_widget;
   GtkWidget *month_widget;
   GtkWidget *day_number_widget;
+  GtkWidget *agenda_widget;
   GThread *thread;
   gboolean should_stop;
   gboolean thread_running;
@@ -75,15 +322,520 @@ typedef struct {
   gchar *previous_day;
   gchar *previous_month;
   gchar *previous_day_number;
+  gchar *previous_agenda;
 } DateData;
 
 static DateData *date_data = NULL;
 
+// Scheduling profile, chosen from power and pressure state
+typedef enum {
+  PROFILE_NORMAL,
+  PROFILE_BATTERY,
+  PROFILE_PRESSURE,
+} SchedulingProfile;
+
+static SchedulingProfile scheduling_profile = PROFILE_NORMAL;
+static gint interval_scale = 1; // Read by workers with g_atomic_int_get
+static guint profile_check_id = 0;
+
+// Header of a cached, pre-decoded wallpaper. The pixels follow directly.
+typedef struct {
+  char magic[8];       // WALLPAPER_CACHE_MAGIC
+  gint64 source_mtime; // Modification time of the image, in nanoseconds
+  gint64 source_size;  // Size of the image file
+  gint32 width;        // Size of the decoded pixels
+  gint32 height;
+  gint32 stride;
+  gint32 format;               // GdkMemoryFormat of the pixels
+  guint32 source_path_length; // The image's path follows the pixels
+} WallpaperCacheHeader;
+
+#define WALLPAPER_CACHE_MAGIC "DTWALL2"
+
+// Where a wallpaper texture came from, attached to it so workers can read
+// its pixels without downloading the texture. The bytes are shared with it.
+typedef struct {
+  gchar *path;
+  GBytes *pixels;
+  int width;
+  int height;
+  int stride;
+  int bpp;         // 4 for R8G8B8A8, 3 for R8G8B8
+  gsize decoded;   // Bytes decoded on the heap (0 when mapped from cache)
+} WallpaperSource;
+
+static gint decoded_wallpaper_kb = 0; // Heap held by live wallpaper pixels
+
+// Colours picked from a wallpaper for BAR_AUTO_THEME
+typedef struct {
+  guint8 dominant[3]; // Bar background
+  guint8 accent[3];   // Bar border
+} BarPalette;
+
+// Bar look derived from one wallpaper, handed to the main thread
+typedef struct {
+  gboolean has_palette;
+  BarPalette palette;
+  gchar *frosted_path; // Blurred strip under the bar (PNG), or NULL
+  int output_width;    // Logical output size the strip was cut for
+  int output_height;
+} BarThemeUpdate;
+
+// Output a window is on, followed for geometry changes
+typedef struct {
+  GdkMonitor *monitor;
+  gulong geometry_handler;
+} OutputWatch;
+
+// Bar theme worker: computes the palette and frosted background of the
+// newest wallpaper shown
+typedef struct {
+  GdkTexture *pending; // Wallpaper waiting to be analyzed
+  int output_width;    // Logical size of the output it is shown on
+  int output_height;
+  GHashTable *cache; // Image key -> BarPalette
+  GThread *thread;
+  gboolean should_stop;
+  gboolean thread_running;
+  GMutex mutex;
+  GCond cond;
+  // Main thread only: what was last requested, so the strip can be cut
+  // again when the bar's output changes
+  GdkTexture *current;
+  int requested_width;
+  int requested_height;
+  OutputWatch output;
+} BarThemeData;
+
+static BarThemeData *bar_theme_data = NULL;
+static GtkWidget *bar_window = NULL; // Its output sizes the frosted strip
+static GtkCssProvider *bar_theme_provider = NULL;
+
+#define BAR_THEME_SAMPLES (1 << 20) // Pixels sampled per wallpaper at most
+
+// Structure to hold wallpaper slideshow state. The worker decodes upcoming
+// wallpapers into ready so the main thread only swaps textures. A single
+// --background-image that is not cached yet is loaded the same way.
+typedef struct {
+  GtkWidget *picture;
+  gchar **paths;
+  guint n_paths;
+  guint next_path;  // Next path the worker decodes
+  guint shown_path; // Path of the frame on screen
+  int width;        // Output size wallpapers are scaled to
+  int height;
+  guint generation; // Bumped when the size changes; older frames are dropped
+  guint max_frames; // Decoded frames retained, including the one on screen
+  GQueue *ready;    // Decoded textures waiting to be shown
+  gboolean showing; // A frame has been handed to the picture
+  guint timeout_id;
+  GThread *thread;
+  gboolean should_stop;
+  gboolean thread_running;
+  GMutex mutex;
+  GCond cond;
+} SlideshowData;
+
+static gchar *background_dir_path = NULL;
+static gchar *background_playlist_path = NULL;
+static gint slideshow_interval = SLIDESHOW_INTERVAL;
+static SlideshowData *slideshow_data = NULL;
+static GtkWidget *background_window = NULL; // Its output sizes wallpapers
+static OutputWatch background_output = {0};
+// Picture showing a cached wallpaper mapped without the slideshow worker,
+// and the output size it was cached for
+static GtkWidget *cached_wallpaper_picture = NULL;
+static int cached_wallpaper_width = -1;
+static int cached_wallpaper_height = -1;
+
+// Chrome trace event. Strings must outlive the trace (literals or config).
+typedef struct {
+  const char *name;
+  const char *detail; // Optional, written as args.detail
+  const char *arg_name; // Optional integer argument
+  gint64 arg;
+  gint64 timestamp; // Monotonic microseconds
+  gint64 duration;  // Only for complete ('X') events
+  char phase;       // 'B', 'E', 'i' or 'X'
+} TraceEvent;
+
+#define TRACE_RING_SIZE 4096 // Events buffered per thread, power of two
+
+// Single-producer ring owned by one thread and drained by the trace writer
+typedef struct {
+  TraceEvent events[TRACE_RING_SIZE];
+  gint head;    // Next slot the owning thread writes
+  gint tail;    // Next slot the writer reads
+  gint dropped; // Events lost because the ring was full
+  pid_t tid;
+  char thread_name[16];
+  gboolean named; // Thread name metadata has been written
+} TraceRing;
+
+// Structure to hold the trace writer thread that flushes all rings to disk
+typedef struct {
+  FILE *file;
+  GPtrArray *rings;
+  GThread *thread;
+  gboolean should_stop;
+  gboolean thread_running;
+  GMutex mutex; // Protects rings and the stop flag
+  GCond cond;
+} TraceData;
+
+#define TRACE_FLUSH_INTERVAL 200 // Milliseconds between flushes
+
+static gchar *trace_path = NULL;
+static gboolean trace_enabled = FALSE;
+static TraceData *trace_data = NULL;
+static GPrivate trace_ring_key = G_PRIVATE_INIT(NULL);
+
+// Record an event only when tracing; arguments are not evaluated otherwise
+#define TRACE(...)                                                             \
+  do {                                                                         \
+    if (G_UNLIKELY(trace_enabled))                                             \
+      trace_record(__VA_ARGS__);                                               \
+  } while (0)
+#define TRACE_BEGIN(name, detail)                                              \
+  TRACE('B', name, detail, g_get_monotonic_time(), 0, NULL, 0)
+#define TRACE_END(name)                                                        \
+  TRACE('E', name, NULL, g_get_monotonic_time(), 0, NULL, 0)
+#define TRACE_INSTANT(name, detail)                                            \
+  TRACE('i', name, detail, g_get_monotonic_time(), 0, NULL, 0)
+#define TRACE_NOW() (trace_enabled ? g_get_monotonic_time() : 0)
+
+// USDT probes (provider desktop_thingy) for bpftrace and perf. Each one is
+// a single nop until a tracer attaches, so probes only pass values that are
+// already at hand; timestamps are CLOCK_MONOTONIC microseconds. Build with
+// USDT=0 (or without sys/sdt.h) to leave them out entirely.
+#if !defined(NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT(name, ...) STAP_PROBEV(desktop_thingy, name, ##__VA_ARGS__)
+#else
+static inline void usdt_unused(int dummy, ...) { (void)dummy; }
+#define USDT(name, ...)                                                        \
+  do {                                                                         \
+    if (0)                                                                     \
+      usdt_unused(0, ##__VA_ARGS__);                                           \
+  } while (0)
+#endif
+
+// Look up or register the calling thread's ring
+static TraceRing *get_trace_ring(void) {
+  TraceRing *ring = g_private_get(&trace_ring_key);
+  if (ring != NULL)
+    return ring;
+
+  ring = g_malloc0(sizeof(TraceRing));
+  ring->tid = gettid();
+  pthread_getname_np(pthread_self(), ring->thread_name,
+                     sizeof(ring->thread_name));
+  g_private_set(&trace_ring_key, ring);
+
+  g_mutex_lock(&trace_data->mutex);
+  g_ptr_array_add(trace_data->rings, ring);
+  g_mutex_unlock(&trace_data->mutex);
+  return ring;
+}
+
+// Append an event to the calling thread's ring without taking any lock
+static void trace_record(char phase, const char *name, const char *detail,
+                         gint64 timestamp, gint64 duration,
+                         const char *arg_name, gint64 arg) {
+  TraceRing *ring = get_trace_ring();
+  guint head = (guint)ring->head;
+  guint tail = (guint)g_atomic_int_get(&ring->tail);
+
+  if (head - tail >= TRACE_RING_SIZE) {
+    g_atomic_int_inc(&ring->dropped);
+    return;
+  }
+
+  TraceEvent *event = &ring->events[head % TRACE_RING_SIZE];
+  event->name = name;
+  event->detail = detail;
+  event->arg_name = arg_name;
+  event->arg = arg;
+  event->timestamp = timestamp;
+  event->duration = duration;
+  event->phase = phase;
+
+  // Publish the slot to the writer
+  g_atomic_int_set(&ring->head, (gint)(head + 1));
+}
+
+// Append a JSON string literal, escaping as needed. Command output may not
+// be UTF-8, so invalid sequences become U+FFFD first.
+static void append_json_string(GString *out, const char *value) {
+  gchar *valid = g_utf8_make_valid(value, -1);
+  g_string_append_c(out, '"');
+  for (const unsigned char *p = (const unsigned char *)valid; *p; p++) {
+    switch (*p) {
+    case '"':
+      g_string_append(out, "\\\"");
+      break;
+    case '\\':
+      g_string_append(out, "\\\\");
+      break;
+    case '\n':
+      g_string_append(out, "\\n");
+      break;
+    case '\t':
+      g_string_append(out, "\\t");
+      break;
+    default:
+      if (*p < 0x20 || *p == 0x7f)
+        g_string_append_printf(out, "\\u%04x", *p);
+      else
+        g_string_append_c(out, *p);
+    }
+  }
+  g_string_append_c(out, '"');
+  g_free(valid);
+}
+
+// Drain every ring into the trace file (trace writer thread only)
+static void flush_trace_rings(TraceData *tdata) {
+  GString *out = g_string_sized_new(4096);
+  pid_t pid = getpid();
+
+  g_mutex_lock(&tdata->mutex);
+  for (guint r = 0; r < tdata->rings->len; r++) {
+    TraceRing *ring = g_ptr_array_index(tdata->rings, r);
+    guint tail = (guint)ring->tail;
+    guint head = (guint)g_atomic_int_get(&ring->head);
+
+    if (!ring->named) {
+      g_string_append_printf(out,
+                             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                             "\"tid\":%d,\"args\":{\"name\":",
+                             pid, ring->tid);
+      append_json_string(out, ring->thread_name);
+      g_string_append(out, "}},\n");
+      ring->named = TRUE;
+    }
+
+    for (; tail != head; tail++) {
+      const TraceEvent *event = &ring->events[tail % TRACE_RING_SIZE];
+      g_string_append(out, "{\"name\":");
+      append_json_string(out, event->name);
+      g_string_append_printf(out,
+                             ",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT
+                             ",\"pid\":%d,\"tid\":%d",
+                             event->phase, event->timestamp, pid, ring->tid);
+      if (event->phase == 'X')
+        g_string_append_printf(out, ",\"dur\":%" G_GINT64_FORMAT,
+                               event->duration);
+      if (event->phase == 'i')
+        g_string_append(out, ",\"s\":\"t\"");
+      if (event->detail != NULL || event->arg_name != NULL) {
+        g_string_append(out, ",\"args\":{");
+        if (event->detail != NULL) {
+          g_string_append(out, "\"detail\":");
+          append_json_string(out, event->detail);
+        }
+        if (event->arg_name != NULL) {
+          g_string_append_printf(out, "%s\"%s\":%" G_GINT64_FORMAT,
+                                 event->detail != NULL ? "," : "",
+                                 event->arg_name, event->arg);
+        }
+        g_string_append_c(out, '}');
+      }
+      g_string_append(out, "},\n");
+    }
+
+    // Hand the slots back to the producer
+    g_atomic_int_set(&ring->tail, (gint)tail);
+  }
+  g_mutex_unlock(&tdata->mutex);
+
+  fwrite(out->str, 1, out->len, tdata->file);
+  g_string_free(out, TRUE);
+}
+
+// Trace writer thread: periodically moves events from the rings to disk so
+// the recording threads never touch the file
+static gpointer trace_writer_thread(gpointer user_data) {
+  TraceData *tdata = (TraceData *)user_data;
+
+  g_mutex_lock(&tdata->mutex);
+  tdata->thread_running = TRUE;
+  g_mutex_unlock(&tdata->mutex);
+
+  while (TRUE) {
+    g_mutex_lock(&tdata->mutex);
+    gint64 end_time =
+        g_get_monotonic_time() + TRACE_FLUSH_INTERVAL * 1000; // microseconds
+    while (!tdata->should_stop) {
+      if (!g_cond_wait_until(&tdata->cond, &tdata->mutex, end_time))
+        break;
+    }
+    gboolean stop = tdata->should_stop;
+    g_mutex_unlock(&tdata->mutex);
+
+    flush_trace_rings(tdata);
+    if (stop)
+      break;
+  }
+
+  g_mutex_lock(&tdata->mutex);
+  tdata->thread_running = FALSE;
+  g_cond_signal(&tdata->cond);
+  g_mutex_unlock(&tdata->mutex);
+
+  return NULL;
+}
+
+// Open the trace file and start recording (--trace)
+static void start_tracing(void) {
+  FILE *file = fopen(trace_path, "w");
+  if (file == NULL) {
+    g_printerr("Failed to open trace file %s: %s\n", trace_path,
+               g_strerror(errno));
+    return;
+  }
+  // JSON array format; viewers accept the unterminated trailing comma form,
+  // and stop_tracing closes it properly
+  fputs("[\n", file);
+
+  trace_data = g_malloc0(sizeof(TraceData));
+  trace_data->file = file;
+  trace_data->rings = g_ptr_array_new_with_free_func(g_free);
+  g_mutex_init(&trace_data->mutex);
+  g_cond_init(&trace_data->cond);
+
+  GError *error = NULL;
+  trace_data->thread =
+      g_thread_try_new("trace-writer", trace_writer_thread, trace_data, &error);
+  if (trace_data->thread == NULL) {
+    g_printerr("Failed to create trace thread: %s\n",
+               error ? error->message : "Unknown error");
+    if (error)
+      g_error_free(error);
+    return;
+  }
+
+  trace_enabled = TRUE;
+}
+
+// Stop recording, flush what is left and close the trace file
+static void stop_tracing(void) {
+  if (trace_data == NULL)
+    return;
+
+  trace_enabled = FALSE;
+
+  g_mutex_lock(&trace_data->mutex);
+  GThread *thread = trace_data->thread;
+  trace_data->should_stop = TRUE;
+  g_cond_signal(&trace_data->cond);
+  trace_data->thread = NULL;
+  g_mutex_unlock(&trace_data->mutex);
+
+  if (thread != NULL)
+    g_thread_join(thread);
+
+  gint dropped = 0;
+  for (guint i = 0; i < trace_data->rings->len; i++) {
+    TraceRing *ring = g_ptr_array_index(trace_data->rings, i);
+    dropped += g_atomic_int_get(&ring->dropped);
+  }
+  if (dropped > 0)
+    g_printerr("Trace dropped %d events (ring buffers full)\n", dropped);
+
+  // Close the array with an empty metadata event so the JSON stays valid
+  fputs("{\"name\":\"trace_end\",\"ph\":\"M\",\"pid\":0,\"tid\":0}\n]\n",
+        trace_data->file);
+  fclose(trace_data->file);
+
+  // Rings of threads that are still alive stay registered with g_private;
+  // nothing records anymore, so they can be freed with the list
+  g_ptr_array_unref(trace_data->rings);
+  g_cond_clear(&trace_data->cond);
+  g_mutex_clear(&trace_data->mutex);
+  g_free(trace_data);
+  trace_data = NULL;
+}
+
+// Wait for a command and collect its resource usage
+static void reap_command(pid_t pid, CommandUsage *usage) {
+  int status = 0;
+  struct rusage rusage;
+  pid_t result;
+  do {
+    result = wait4(pid, &status, 0, &rusage);
+  } while (result < 0 && errno == EINTR);
+
+  if (usage == NULL || result < 0)
+    return;
+
+  usage->runs = 1;
+  usage->failures = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+  usage->user_us = rusage.ru_utime.tv_sec * G_USEC_PER_SEC +
+                   rusage.ru_utime.tv_usec;
+  usage->sys_us = rusage.ru_stime.tv_sec * G_USEC_PER_SEC +
+                  rusage.ru_stime.tv_usec;
+  usage->max_rss_kb = rusage.ru_maxrss;
+  usage->last_status = status;
+}
+
+// Add one command run to a module's totals
+static void account_command_usage(ModuleStats *stats,
+                                  const CommandUsage *usage) {
+  if (usage->runs == 0 && usage->cache_hits == 0)
+    return;
+
+  g_mutex_lock(&stats->usage_lock);
+  stats->usage.cache_hits += usage->cache_hits;
+  if (usage->runs == 0) {
+    g_mutex_unlock(&stats->usage_lock);
+    return;
+  }
+
+  stats->usage.runs += usage->runs;
+  stats->usage.failures += usage->failures;
+  stats->usage.user_us += usage->user_us;
+  stats->usage.sys_us += usage->sys_us;
+  stats->usage.max_rss_kb = MAX(stats->usage.max_rss_kb, usage->max_rss_kb);
+  stats->usage.last_status = usage->last_status;
+  g_mutex_unlock(&stats->usage_lock);
+}
+
 // Execute command and return output
-static gchar *execute_command(const char *command) {
-  FILE *fp = popen(command, "r");
-  if (fp == NULL)
+static gchar *execute_command(const char *command, CommandUsage *usage) {
+  if (usage != NULL)
+    memset(usage, 0, sizeof(CommandUsage));
+
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+    return NULL;
+
+  // Run through /bin/sh like popen, keeping the pid for tracing
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+  char *argv[] = {"sh", "-c", (char *)command, NULL};
+
+  gint64 start_time = TRACE_NOW();
+  pid_t pid;
+  int spawn_result =
+      posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipe_fds[1]);
+
+  if (spawn_result != 0) {
+    close(pipe_fds[0]);
+    return NULL;
+  }
+  TRACE('B', "execute_command", command, start_time, 0, "pid", pid);
+
+  FILE *fp = fdopen(pipe_fds[0], "r");
+  if (fp == NULL) {
+    close(pipe_fds[0]);
+    reap_command(pid, usage);
+    TRACE_END("execute_command");
     return NULL;
+  }
 
   gchar *output = NULL;
   gsize len = 0;
@@ -97,7 +849,9 @@ static gchar *execute_command(const char *command) {
     output[len] = '\0';
   }
 
-  pclose(fp);
+  fclose(fp);
+  reap_command(pid, usage);
+  TRACE_END("execute_command");
 
   // Remove trailing newline if present
   if (output != NULL && len > 0 && output[len - 1] == '\n') {
@@ -107,478 +861,5337 @@ static gchar *execute_command(const char *command) {
   return output;
 }
 
-// Idle callback to update UI from main thread (called when worker thread
-// signals)
-static gboolean update_ui_from_main_thread(gpointer user_data) {
-  UpdateData *update_data = (UpdateData *)user_data;
-
-  if (update_data->widget != NULL && update_data->new_output != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->widget), update_data->new_output);
+// User and system CPU time of a shell and the children it has reaped, in
+// clock ticks
+static void read_shell_cpu_ticks(pid_t pid, gint64 *user, gint64 *sys) {
+  *user = 0;
+  *sys = 0;
+
+  gchar *path = g_strdup_printf("/proc/%d/stat", pid);
+  gchar *contents = NULL;
+  gboolean ok = g_file_get_contents(path, &contents, NULL, NULL);
+  g_free(path);
+  if (!ok)
+    return;
+
+  // Fields after the command name, which may contain spaces: utime, stime,
+  // cutime and cstime are fields 14 to 17
+  const char *p = strrchr(contents, ')');
+  if (p != NULL) {
+    gchar **fields = g_strsplit(p + 2, " ", 16);
+    if (g_strv_length(fields) >= 16) {
+      *user = g_ascii_strtoll(fields[11], NULL, 10) +
+              g_ascii_strtoll(fields[13], NULL, 10);
+      *sys = g_ascii_strtoll(fields[12], NULL, 10) +
+             g_ascii_strtoll(fields[14], NULL, 10);
+    }
+    g_strfreev(fields);
   }
+  g_free(contents);
+}
 
-  // Free the update data
-  g_free(update_data->new_output);
-  g_free(update_data);
+static void stop_shell_coprocess(ShellCoprocess *shell) {
+  if (shell->pid <= 0)
+    return;
+
+  // The shell leads its own process group, so this also ends a command
+  // that is still running
+  kill(-shell->pid, SIGKILL);
+  close(shell->fd);
+  while (waitpid(shell->pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+  shell->pid = 0;
+  shell->fd = -1;
+  g_string_truncate(shell->buffer, 0);
+}
 
-  return G_SOURCE_REMOVE; // Remove the idle source after execution
+static gboolean start_shell_coprocess(ShellCoprocess *shell) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    return FALSE;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+  char *argv[] = {"sh", NULL};
+
+  pid_t pid;
+  int spawn_result =
+      posix_spawn(&pid, "/bin/sh", &actions, &attributes, argv, environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+
+  if (spawn_result != 0) {
+    close(fds[0]);
+    return FALSE;
+  }
+
+  shell->pid = pid;
+  shell->fd = fds[0];
+  if (shell->buffer == NULL)
+    shell->buffer = g_string_new(NULL);
+  read_shell_cpu_ticks(pid, &shell->user_ticks, &shell->sys_ticks);
+  TRACE_INSTANT("shell_start", "sh");
+  return TRUE;
 }
 
-// Idle callback to update weather UI from main thread
-static gboolean update_weather_ui_from_main_thread(gpointer user_data) {
-  WeatherUpdateData *update_data = (WeatherUpdateData *)user_data;
+// Run a command in a module's persistent shell. The output ends at a
+// delimiter unique to this run, followed by the command's exit status. A
+// shell that dies or takes longer than SHELL_COMMAND_TIMEOUT is restarted.
+static gchar *execute_shell_command(ShellCoprocess *shell, const char *command,
+                                    CommandUsage *usage) {
+  if (usage != NULL)
+    memset(usage, 0, sizeof(CommandUsage));
 
-  if (update_data->emoji_widget != NULL && update_data->new_emoji != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->emoji_widget),
-                       update_data->new_emoji);
-  }
+  if (shell->pid <= 0 && !start_shell_coprocess(shell))
+    return NULL;
+
+  // Commands read /dev/null so they cannot consume the shell's input
+  gchar *delimiter = g_strdup_printf("__desktop_thingy_%d_%" G_GUINT64_FORMAT
+                                     "__",
+                                     shell->pid, ++shell->sequence);
+  gchar *script = g_strdup_printf("{ %s\n} </dev/null\n"
+                                  "printf '\\n%%s %%d\\n' '%s' $?\n",
+                                  command, delimiter);
+  gchar *marker = g_strdup_printf("\n%s ", delimiter);
+
+  gint64 start_time = TRACE_NOW();
+  TRACE('B', "execute_shell_command", command, start_time, 0, "pid",
+        shell->pid);
+
+  gsize script_len = strlen(script);
+  gboolean ok = send(shell->fd, script, script_len, MSG_NOSIGNAL) ==
+                (ssize_t)script_len;
+
+  gint64 deadline = g_get_monotonic_time() +
+                    (gint64)SHELL_COMMAND_TIMEOUT * 1000;
+  gchar *output = NULL;
+  int status = 0;
+  while (ok) {
+    gchar *found = strstr(shell->buffer->str, marker);
+    gchar *line_end = found ? strchr(found + strlen(marker), '\n') : NULL;
+    if (line_end != NULL) {
+      status = atoi(found + strlen(marker));
+      output = g_strndup(shell->buffer->str, found - shell->buffer->str);
+      g_string_erase(shell->buffer, 0, line_end + 1 - shell->buffer->str);
+      break;
+    }
+
+    gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+    struct pollfd poll_fd = {.fd = shell->fd, .events = POLLIN};
+    int ready = remaining > 0 ? poll(&poll_fd, 1, (int)remaining) : 0;
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0) {
+      ok = FALSE;
+      break;
+    }
 
-  if (update_data->temp_widget != NULL && update_data->new_temp != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->temp_widget),
-                       update_data->new_temp);
+    char buffer[1024];
+    ssize_t length = read(shell->fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR)
+      continue;
+    if (length <= 0) {
+      ok = FALSE;
+      break;
+    }
+    g_string_append_len(shell->buffer, buffer, length);
+  }
+  TRACE_END("execute_shell_command");
+
+  g_free(marker);
+  g_free(script);
+  g_free(delimiter);
+
+  if (!ok) {
+    g_printerr("Restarting shell for module command '%s'\n", command);
+    stop_shell_coprocess(shell);
+    shell->restarts++;
+    if (usage != NULL) {
+      usage->runs = 1;
+      usage->failures = 1;
+    }
+    return NULL;
   }
 
-  // Free the update data
-  g_free(update_data->new_emoji);
-  g_free(update_data->new_temp);
-  g_free(update_data);
+  // Children the shell reaped count towards its cumulative times
+  gint64 user_ticks, sys_ticks;
+  read_shell_cpu_ticks(shell->pid, &user_ticks, &sys_ticks);
+  if (usage != NULL) {
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    gint64 user_us = (user_ticks - shell->user_ticks) * G_USEC_PER_SEC /
+                     ticks_per_second;
+    gint64 sys_us =
+        (sys_ticks - shell->sys_ticks) * G_USEC_PER_SEC / ticks_per_second;
+    usage->runs = 1;
+    usage->failures = status == 0 ? 0 : 1;
+    usage->user_us = MAX(user_us, 0);
+    usage->sys_us = MAX(sys_us, 0);
+    usage->last_status = (status & 0xff) << 8;
+  }
+  shell->user_ticks = user_ticks;
+  shell->sys_ticks = sys_ticks;
 
-  return G_SOURCE_REMOVE;
+  // Remove trailing newline if present, like execute_command
+  gsize len = strlen(output);
+  if (len > 0 && output[len - 1] == '\n')
+    output[len - 1] = '\0';
+  return output;
 }
 
-// Idle callback to update date UI from main thread
-static gboolean update_date_ui_from_main_thread(gpointer user_data) {
-  DateUpdateData *update_data = (DateUpdateData *)user_data;
+// Cache key for a command: surrounding whitespace trimmed and unquoted runs
+// of whitespace collapsed, so formatting differences still share a result
+static gchar *normalize_command(const char *command) {
+  GString *key = g_string_sized_new(strlen(command));
+  char quote = '\0';
+  gboolean pending_space = FALSE;
+
+  for (const char *p = command; *p != '\0'; p++) {
+    if (quote == '\0' && g_ascii_isspace(*p)) {
+      pending_space = key->len > 0;
+      continue;
+    }
 
-  if (update_data->day_widget != NULL && update_data->new_day != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->day_widget),
-                       update_data->new_day);
-  }
+    if (pending_space) {
+      g_string_append_c(key, ' ');
+      pending_space = FALSE;
+    }
 
-  if (update_data->month_widget != NULL && update_data->new_month != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->month_widget),
-                       update_data->new_month);
+    if (*p == '\\' && quote != '\'' && p[1] != '\0') {
+      g_string_append_c(key, *p++);
+    } else if (quote == '\0' && (*p == '\'' || *p == '"')) {
+      quote = *p;
+    } else if (*p == quote) {
+      quote = '\0';
+    }
+    g_string_append_c(key, *p);
   }
 
-  if (update_data->day_number_widget != NULL &&
-      update_data->new_day_number != NULL) {
-    gtk_label_set_text(GTK_LABEL(update_data->day_number_widget),
-                       update_data->new_day_number);
+  return g_string_free(key, FALSE);
+}
+
+static void free_command_cache_entry(gpointer data) {
+  CommandCacheEntry *entry = data;
+  g_free(entry->output);
+  g_free(entry);
+}
+
+// Run a command unless another worker ran it within max_age_ms, in which
+// case its output is shared. Identical commands that are already running
+// are waited for instead of being started again, even with max_age_ms 0,
+// but only for COMMAND_CACHE_WAIT. With a shell the command runs there
+// instead of in a new /bin/sh. Only workers with the same nice level,
+// priority and shell mode share runs, so a normal worker never waits on a
+// deprioritized one.
+static gchar *run_cached_command(const char *command, int max_age_ms,
+                                 ShellCoprocess *shell, int nice,
+                                 BarPriority priority, CommandUsage *usage) {
+  gchar *normalized = normalize_command(command);
+  gchar *key = g_strdup_printf("%d:%d:%d:%s", nice, priority, shell != NULL,
+                               normalized);
+  g_free(normalized);
+
+  g_mutex_lock(&command_cache_lock);
+  if (command_cache == NULL)
+    command_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          free_command_cache_entry);
+
+  CommandCacheEntry *entry = g_hash_table_lookup(command_cache, key);
+  if (entry != NULL) {
+    gboolean waited = FALSE;
+    gint64 deadline =
+        g_get_monotonic_time() + (gint64)COMMAND_CACHE_WAIT * 1000;
+    while (entry->running) {
+      waited = TRUE;
+      if (!g_cond_wait_until(&command_cache_cond, &command_cache_lock,
+                             deadline) &&
+          entry->running) {
+        // The owner is stuck; run it without touching the shared entry
+        g_mutex_unlock(&command_cache_lock);
+        g_free(key);
+        return shell != NULL ? execute_shell_command(shell, command, usage)
+                             : execute_command(command, usage);
+      }
+    }
+
+    if (waited || g_get_monotonic_time() - entry->finished <=
+                      (gint64)max_age_ms * 1000) {
+      gchar *output = g_strdup(entry->output);
+      g_mutex_unlock(&command_cache_lock);
+      g_free(key);
+
+      if (usage != NULL) {
+        memset(usage, 0, sizeof(CommandUsage));
+        usage->cache_hits = 1;
+      }
+      TRACE_INSTANT("command_cache_hit", command);
+      return output;
+    }
+  } else {
+    entry = g_new0(CommandCacheEntry, 1);
+    g_hash_table_insert(command_cache, key, entry);
+    key = NULL;
   }
 
-  // Free the update data
-  g_free(update_data->new_day);
-  g_free(update_data->new_month);
-  g_free(update_data->new_day_number);
-  g_free(update_data);
+  entry->running = TRUE;
+  g_mutex_unlock(&command_cache_lock);
+  g_free(key);
 
-  return G_SOURCE_REMOVE;
-}
+  gchar *output = shell != NULL
+                      ? execute_shell_command(shell, command, usage)
+                      : execute_command(command, usage);
 
-// Worker thread function: polls at module interval and signals main thread on
-// change
-static gpointer module_worker_thread(gpointer user_data) {
-  BarItemData *item_data = (BarItemData *)user_data;
+  // Entries are only freed at exit, so the pointer is still valid
+  g_mutex_lock(&command_cache_lock);
+  g_free(entry->output);
+  entry->output = g_strdup(output);
+  entry->finished = g_get_monotonic_time();
+  entry->running = FALSE;
+  g_cond_broadcast(&command_cache_cond);
+  g_mutex_unlock(&command_cache_lock);
 
-  // Mark thread as running
-  g_mutex_lock(&item_data->mutex);
-  item_data->thread_running = TRUE;
-  g_mutex_unlock(&item_data->mutex);
+  return output;
+}
 
-  // Initial update
-  gchar *output = execute_command(item_data->command);
-  g_mutex_lock(&item_data->mutex);
-  item_data->previous_output = output ? g_strdup(output) : g_strdup("");
-  g_mutex_unlock(&item_data->mutex);
+// Compile an extractor regex once and share it between threads. NULL for a
+// missing or invalid pattern.
+static GRegex *get_extract_regex(const char *pattern) {
+  if (pattern == NULL)
+    return NULL;
 
-  // Signal main thread to update UI (always update on initial run)
-  // Read widget pointer with mutex protection (though it's set during init
-  // and never modified)
-  g_mutex_lock(&item_data->mutex);
-  GtkWidget *widget = item_data->widget;
-  g_mutex_unlock(&item_data->mutex);
+  g_mutex_lock(&extract_regex_lock);
+  if (extract_regex_cache == NULL)
+    extract_regex_cache =
+        g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                              (GDestroyNotify)g_regex_unref);
+
+  GRegex *regex = NULL;
+  if (!g_hash_table_lookup_extended(extract_regex_cache, pattern, NULL,
+                                    (gpointer *)&regex)) {
+    GError *error = NULL;
+    regex = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &error);
+    if (regex == NULL) {
+      g_printerr("Invalid extractor pattern '%s': %s\n", pattern,
+                 error->message);
+      g_error_free(error);
+    }
+    g_hash_table_insert(extract_regex_cache, (gpointer)pattern, regex);
+  }
+  g_mutex_unlock(&extract_regex_lock);
 
-  UpdateData *update_data = g_malloc(sizeof(UpdateData));
-  update_data->widget = widget;
-  update_data->new_output = output ? g_strdup(output) : g_strdup("");
-  g_idle_add(update_ui_from_main_thread, update_data);
+  return regex;
+}
 
-  if (output != NULL) {
-    g_free(output);
+// Field n (1-based) of text, split like awk on runs of whitespace or like
+// cut on a literal delimiter. Missing fields are empty.
+static gchar *extract_field(const gchar *text, const char *delimiter, int n) {
+  gchar **fields = delimiter != NULL ? g_strsplit(text, delimiter, -1)
+                                     : g_strsplit_set(text, " \t\n", -1);
+  gchar *result = NULL;
+  int index = 0;
+
+  for (gchar **field = fields; *field != NULL && result == NULL; field++) {
+    if (delimiter == NULL && **field == '\0')
+      continue;
+    if (++index == n)
+      result = g_strdup(*field);
   }
 
-  // Poll at module's interval
-  while (TRUE) {
-    g_mutex_lock(&item_data->mutex);
+  g_strfreev(fields);
+  return result != NULL ? result : g_strdup("");
+}
 
-    // Wait for interval or stop signal (interruptible sleep)
-    gint64 end_time =
-        g_get_monotonic_time() + (item_data->interval * 1000); // microseconds
+// Extract a value from command output; NULL output stays NULL, and regex or
+// template extractors without a pattern keep the output as it is
+static gchar *extract_value(const Extractor *extract, const gchar *output) {
+  if (output == NULL)
+    return NULL;
+  if ((extract->kind == EXTRACT_REGEX || extract->kind == EXTRACT_TEMPLATE) &&
+      extract->pattern == NULL)
+    return g_strdup(output);
+
+  switch (extract->kind) {
+  case EXTRACT_FIELD:
+    return extract_field(output, extract->delimiter, extract->field);
+
+  case EXTRACT_REGEX: {
+    GRegex *regex = get_extract_regex(extract->pattern);
+    GMatchInfo *match_info = NULL;
+    gchar *result = NULL;
+
+    if (regex != NULL && g_regex_match(regex, output, 0, &match_info)) {
+      int group = g_regex_get_capture_count(regex) > 0 ? 1 : 0;
+      result = g_match_info_fetch(match_info, group);
+    }
+    g_match_info_free(match_info);
+    return result != NULL ? result : g_strdup("");
+  }
 
-    // Wait with timeout - will wake up on cond signal or timeout
-    while (!item_data->should_stop) {
-      if (!g_cond_wait_until(&item_data->cond, &item_data->mutex, end_time)) {
-        // Timeout occurred - break to execute command
-        break;
+  case EXTRACT_TEMPLATE: {
+    GString *result = g_string_new(NULL);
+    for (const char *p = extract->pattern; *p != '\0'; p++) {
+      char *end;
+      long n;
+      if (*p == '{' && g_ascii_isdigit(p[1]) &&
+          (n = strtol(p + 1, &end, 10), *end == '}')) {
+        if (n == 0) {
+          g_string_append(result, output);
+        } else {
+          gchar *field = extract_field(output, NULL, (int)n);
+          g_string_append(result, field);
+          g_free(field);
+        }
+        p = end;
+      } else {
+        g_string_append_c(result, *p);
       }
-      // If woken by signal and should_stop is true, break
-      if (item_data->should_stop)
-        break;
     }
+    return g_string_free(result, FALSE);
+  }
 
-    if (item_data->should_stop) {
-      g_mutex_unlock(&item_data->mutex);
-      break;
-    }
-    g_mutex_unlock(&item_data->mutex);
+  case EXTRACT_NONE:
+  default:
+    return g_strdup(output);
+  }
+}
 
-    // Execute command to get new output
-    output = execute_command(item_data->command);
+// Replace output with the extracted value, taking ownership of output
+static gchar *apply_extractor(const Extractor *extract, gchar *output) {
+  if (extract == NULL || extract->kind == EXTRACT_NONE)
+    return output;
 
-    g_mutex_lock(&item_data->mutex);
+  gchar *value = extract_value(extract, output);
+  g_free(output);
+  return value;
+}
 
-    // Normalize blank output: treat NULL and empty string as blank
-    // Convert NULL to empty string for comparison
-    const char *current_output = (output == NULL) ? "" : output;
-    const char *previous_output =
-        (item_data->previous_output == NULL) ? "" : item_data->previous_output;
+// Record one latency sample (microseconds) into a histogram
+static void record_latency(LatencyHistogram *histogram, gint64 latency_us) {
+  guint64 value = latency_us > 0 ? (guint64)latency_us : 0;
+  int bucket = value > 0 ? g_bit_storage(value) : 0;
 
-    gboolean current_is_blank = (strlen(current_output) == 0);
-    gboolean previous_is_blank = (strlen(previous_output) == 0);
+  histogram->count++;
+  histogram->total_us += value;
+  histogram->max_us = MAX(histogram->max_us, value);
+  histogram->buckets[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+}
 
-    // Compare with previous output - signal if changed
-    // Skip update only if both are blank (no change from blank to blank)
-    gboolean should_update = FALSE;
-    if (current_is_blank && previous_is_blank) {
-      // Both blank - no change, skip update
-      should_update = FALSE;
-    } else {
-      // At least one is not blank - compare strings
-      should_update = (strcmp(previous_output, current_output) != 0);
-    }
+// Upper bound in milliseconds of the bucket containing the given percentile
+static double latency_percentile_ms(const LatencyHistogram *histogram,
+                                    double percentile) {
+  guint64 target = (guint64)(histogram->count * percentile / 100.0);
+  guint64 seen = 0;
 
-    if (should_update) {
-      // Data changed - signal main thread to update UI
-      // Read widget pointer while holding mutex
-      GtkWidget *widget = item_data->widget;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > target)
+      return MIN((double)(1ULL << i), (double)histogram->max_us) / 1000.0;
+  }
+  return histogram->max_us / 1000.0;
+}
 
-      UpdateData *update_data = g_malloc(sizeof(UpdateData));
-      update_data->widget = widget;
-      update_data->new_output = output ? g_strdup(output) : g_strdup("");
+static void print_latency(const char *label,
+                          const LatencyHistogram *histogram) {
+  if (histogram->count == 0)
+    return;
+
+  g_printerr("    %-8s n=%" G_GUINT64_FORMAT " avg=%.2fms p50<=%.2fms "
+             "p90<=%.2fms p99<=%.2fms max=%.2fms\n",
+             label, histogram->count,
+             histogram->total_us / (double)histogram->count / 1000.0,
+             latency_percentile_ms(histogram, 50),
+             latency_percentile_ms(histogram, 90),
+             latency_percentile_ms(histogram, 99), histogram->max_us / 1000.0);
+}
 
-      // Update stored previous output
-      g_free(item_data->previous_output);
-      item_data->previous_output = output ? g_strdup(output) : g_strdup("");
+// Queue an applied update so its paint and presentation time get recorded
+static void track_frame_update(GtkWidget *widget, ModuleStats *stats,
+                               gint64 ready_time) {
+  if (widget == NULL || stats == NULL)
+    return;
+
+  GtkNative *native = gtk_widget_get_native(widget);
+  WindowStats *window_stats =
+      native ? g_object_get_data(G_OBJECT(native), "frame-stats") : NULL;
+  if (window_stats == NULL)
+    return;
+
+  // Several labels of one module updated together count once
+  for (guint i = 0; i < window_stats->pending->len; i++) {
+    PendingFrameUpdate *pending =
+        &g_array_index(window_stats->pending, PendingFrameUpdate, i);
+    if (pending->module == stats && pending->ready_time == ready_time)
+      return;
+  }
 
-      g_mutex_unlock(&item_data->mutex);
+  // Bound the backlog in case the window stops producing frames
+  if (window_stats->pending->len >= 256)
+    g_array_remove_index(window_stats->pending, 0);
 
-      // Queue update to main thread
-      g_idle_add(update_ui_from_main_thread, update_data);
-    } else {
-      g_mutex_unlock(&item_data->mutex);
-    }
+  PendingFrameUpdate pending = {.module = stats, .ready_time = ready_time};
+  g_array_append_val(window_stats->pending, pending);
+}
 
-    if (output != NULL) {
-      g_free(output);
-    }
+static void on_frame_before_paint(GdkFrameClock *clock, gpointer user_data) {
+  (void)clock;
+  WindowStats *stats = (WindowStats *)user_data;
+  stats->frame_start_time = g_get_monotonic_time();
+  stats->layout_done_time = 0;
+}
+
+// Connected after GDK's own handler, so this runs once layout is done
+static void on_frame_layout(GdkFrameClock *clock, gpointer user_data) {
+  (void)clock;
+  WindowStats *stats = (WindowStats *)user_data;
+  stats->layout_done_time = g_get_monotonic_time();
+}
+
+static void on_frame_after_paint(GdkFrameClock *clock, gpointer user_data) {
+  WindowStats *stats = (WindowStats *)user_data;
+  gint64 now = g_get_monotonic_time();
+  gint64 frame_counter = gdk_frame_clock_get_frame_counter(clock);
+
+  if (stats->first_paint_time == 0)
+    stats->first_paint_time = now;
+
+  if (stats->frame_start_time > 0 && stats->layout_done_time > 0) {
+    record_latency(&stats->layout,
+                   stats->layout_done_time - stats->frame_start_time);
+    record_latency(&stats->paint, now - stats->layout_done_time);
   }
 
-  // Mark thread as no longer running
-  g_mutex_lock(&item_data->mutex);
-  item_data->thread_running = FALSE;
-  g_cond_signal(&item_data->cond); // Signal in case cleanup is waiting
-  g_mutex_unlock(&item_data->mutex);
+  // Everything applied before this frame has now been painted
+  PendingFrameUpdate frame = {.frame_counter = frame_counter,
+                              .painted_time = now};
+  g_array_append_val(stats->awaiting, frame);
+  for (guint i = 0; i < stats->pending->len; i++) {
+    PendingFrameUpdate *pending =
+        &g_array_index(stats->pending, PendingFrameUpdate, i);
+    record_latency(&pending->module->paint, now - pending->ready_time);
+    pending->frame_counter = frame_counter;
+    pending->painted_time = now;
+    g_array_append_val(stats->awaiting, *pending);
+  }
+  g_array_set_size(stats->pending, 0);
+
+  // Resolve earlier frames whose presentation feedback has arrived. Timings
+  // that fell out of the frame clock history or never report a
+  // presentation time are dropped.
+  guint i = 0;
+  while (i < stats->awaiting->len) {
+    PendingFrameUpdate *entry =
+        &g_array_index(stats->awaiting, PendingFrameUpdate, i);
+    GdkFrameTimings *timings =
+        gdk_frame_clock_get_timings(clock, entry->frame_counter);
+
+    if (timings != NULL && !gdk_frame_timings_get_complete(timings)) {
+      i++;
+      continue;
+    }
 
-  return NULL;
+    gint64 presented =
+        timings ? gdk_frame_timings_get_presentation_time(timings) : 0;
+    if (presented > 0) {
+      if (entry->module == NULL)
+        record_latency(&stats->present, presented - entry->painted_time);
+      else
+        record_latency(&entry->module->present, presented - entry->ready_time);
+    }
+    g_array_remove_index(stats->awaiting, i);
+  }
 }
 
-// Weather worker thread function: polls at interval and signals main thread on
-// change
-static gpointer weather_worker_thread(gpointer user_data) {
-  WeatherData *wdata = (WeatherData *)user_data;
+static void on_window_realize_stats(GtkWidget *window, gpointer user_data) {
+  GdkFrameClock *clock = gtk_widget_get_frame_clock(window);
+  if (clock == NULL)
+    return;
 
-  // Mark thread as running
-  g_mutex_lock(&wdata->mutex);
-  wdata->thread_running = TRUE;
-  g_mutex_unlock(&wdata->mutex);
+  g_signal_connect(clock, "before-paint", G_CALLBACK(on_frame_before_paint),
+                   user_data);
+  g_signal_connect(clock, "layout", G_CALLBACK(on_frame_layout), user_data);
+  g_signal_connect(clock, "after-paint", G_CALLBACK(on_frame_after_paint),
+                   user_data);
+}
 
-  // Initial update
-  gchar *emoji = execute_command(WEATHER_EMOJI_COMMAND);
-  gchar *temp = execute_command(WEATHER_TEMP_COMMAND);
+// Start collecting frame timings for a window
+static void attach_window_stats(GtkWidget *window, WindowStats *stats) {
+  if (stats->pending == NULL) {
+    stats->pending = g_array_new(FALSE, FALSE, sizeof(PendingFrameUpdate));
+    stats->awaiting = g_array_new(FALSE, FALSE, sizeof(PendingFrameUpdate));
+  }
+  g_object_set_data(G_OBJECT(window), "frame-stats", stats);
+  g_signal_connect(window, "realize", G_CALLBACK(on_window_realize_stats),
+                   stats);
+}
 
-  if (emoji != NULL || temp != NULL) {
-    g_mutex_lock(&wdata->mutex);
-    if (emoji != NULL)
-      wdata->previous_emoji = g_strdup(emoji);
-    if (temp != NULL)
-      wdata->previous_temp = g_strdup(temp);
+static void print_module_stats(ModuleStats *stats) {
+  g_mutex_lock(&stats->usage_lock);
+  CommandUsage usage = stats->usage;
+  int stretched_interval = stats->stretched_interval;
+  g_mutex_unlock(&stats->usage_lock);
+
+  if (stats->name == NULL || (stats->queue.count == 0 && usage.runs == 0 &&
+                              usage.cache_hits == 0))
+    return;
+
+  g_printerr("  module %s\n", stats->name);
+  print_latency("queue", &stats->queue);
+  print_latency("paint", &stats->paint);
+  print_latency("present", &stats->present);
+
+  if (usage.runs > 0 || usage.cache_hits > 0) {
+    g_printerr("    %-8s n=%" G_GUINT64_FORMAT " shared=%" G_GUINT64_FORMAT
+               " user=%.1fms sys=%.1fms avg=%.2fms max_rss=%ldKiB\n",
+               "cpu", usage.runs, usage.cache_hits, usage.user_us / 1000.0,
+               usage.sys_us / 1000.0,
+               usage.runs > 0
+                   ? (usage.user_us + usage.sys_us) / 1000.0 / usage.runs
+                   : 0.0,
+               usage.max_rss_kb);
+
+    if (WIFSIGNALED(usage.last_status))
+      g_printerr("    %-8s failed=%" G_GUINT64_FORMAT " last=signal %d\n",
+                 "exit", usage.failures, WTERMSIG(usage.last_status));
+    else
+      g_printerr("    %-8s failed=%" G_GUINT64_FORMAT " last=%d\n", "exit",
+                 usage.failures, WEXITSTATUS(usage.last_status));
+  }
 
-    GtkWidget *emoji_widget = wdata->emoji_widget;
-    GtkWidget *temp_widget = wdata->temp_widget;
-    g_mutex_unlock(&wdata->mutex);
+  if (stretched_interval > 0)
+    g_printerr("    %-8s stretched to %dms by CPU budget\n", "interval",
+               stretched_interval);
+}
 
-    WeatherUpdateData *update_data = g_malloc(sizeof(WeatherUpdateData));
-    update_data->emoji_widget = emoji_widget;
-    update_data->temp_widget = temp_widget;
-    update_data->new_emoji = emoji ? g_strdup(emoji) : NULL;
-    update_data->new_temp = temp ? g_strdup(temp) : NULL;
-    g_idle_add(update_weather_ui_from_main_thread, update_data);
+static void print_window_stats(const WindowStats *stats) {
+  if (stats->layout.count == 0)
+    return;
 
-    g_free(emoji);
-    g_free(temp);
-  }
+  g_printerr("  window %s\n", stats->name);
+  print_latency("layout", &stats->layout);
+  print_latency("paint", &stats->paint);
+  print_latency("present", &stats->present);
+}
 
-  // Poll at weather update interval
-  while (TRUE) {
-    g_mutex_lock(&wdata->mutex);
+static void print_first_paint(const WindowStats *stats) {
+  if (stats->first_paint_time == 0)
+    return;
 
-    // Wait for interval or stop signal
-    gint64 end_time = g_get_monotonic_time() +
-                      (WEATHER_UPDATE_INTERVAL * 1000); // microseconds
+  g_printerr("  window %s first paint %.2fms after start\n", stats->name,
+             (stats->first_paint_time - startup_time) / 1000.0);
+}
 
-    while (!wdata->should_stop) {
-      if (!g_cond_wait_until(&wdata->cond, &wdata->mutex, end_time)) {
-        break;
-      }
-      if (wdata->should_stop)
-        break;
+// Resident memory of the process by what it holds, from /proc/self/smaps.
+// Thread stacks are told apart from malloc arenas by the guard page below
+// them, so the split is approximate.
+typedef struct {
+  gint64 heap_kb;      // brk heap and anonymous memory (malloc arenas)
+  gint64 stacks_kb;    // Main and thread stacks
+  gint64 textures_kb;  // Wallpaper pixels, decoded or mapped from the cache
+  gint64 libraries_kb; // Shared libraries
+  gint64 other_kb;     // Other files (fonts, caches, devices) and the rest
+  gint64 total_kb;
+} MemoryFootprint;
+
+static void read_memory_footprint(MemoryFootprint *footprint) {
+  memset(footprint, 0, sizeof(*footprint));
+
+  FILE *fp = fopen("/proc/self/smaps", "r");
+  if (fp == NULL)
+    return;
+
+  gint64 *category = &footprint->other_kb;
+  unsigned long previous_end = 0;
+  gboolean previous_guard = FALSE;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned long start, end;
+    char perms[5];
+    int name_offset = 0;
+    if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %n", &start, &end, perms,
+               &name_offset) == 3 &&
+        name_offset > 0) {
+      gchar *name = g_strstrip(line + name_offset);
+      gboolean anonymous = *name == '\0';
+
+      if (strcmp(name, "[heap]") == 0)
+        category = &footprint->heap_kb;
+      else if (strcmp(name, "[stack]") == 0)
+        category = &footprint->stacks_kb;
+      else if (strstr(name, "/desktop-thingy/wallpaper-") != NULL)
+        category = &footprint->textures_kb;
+      else if (strstr(name, ".so") != NULL && *name == '/')
+        category = &footprint->libraries_kb;
+      else if (anonymous && previous_guard && previous_end == start)
+        category = &footprint->stacks_kb;
+      else if (anonymous)
+        category = &footprint->heap_kb;
+      else
+        category = &footprint->other_kb;
+
+      previous_guard = anonymous && strcmp(perms, "---p") == 0;
+      previous_end = end;
+      continue;
     }
 
-    if (wdata->should_stop) {
-      g_mutex_unlock(&wdata->mutex);
-      break;
+    gint64 rss_kb;
+    if (sscanf(line, "Rss: %" G_GINT64_FORMAT " kB", &rss_kb) == 1) {
+      *category += rss_kb;
+      footprint->total_kb += rss_kb;
     }
-    g_mutex_unlock(&wdata->mutex);
-
-    // Execute commands to get new weather data
-    emoji = execute_command(WEATHER_EMOJI_COMMAND);
-    temp = execute_command(WEATHER_TEMP_COMMAND);
-
-    if (emoji != NULL || temp != NULL) {
-      g_mutex_lock(&wdata->mutex);
+  }
+  fclose(fp);
 
-      gboolean emoji_changed = FALSE;
-      gboolean temp_changed = FALSE;
+  // Decoded wallpapers live in the heap; count them as textures
+  gint64 decoded_kb = MIN(g_atomic_int_get(&decoded_wallpaper_kb),
+                          footprint->heap_kb);
+  footprint->heap_kb -= decoded_kb;
+  footprint->textures_kb += decoded_kb;
+}
 
-      if (emoji != NULL && (wdata->previous_emoji == NULL ||
-                            strcmp(wdata->previous_emoji, emoji) != 0)) {
-        emoji_changed = TRUE;
-        g_free(wdata->previous_emoji);
-        wdata->previous_emoji = g_strdup(emoji);
-      }
+static void print_memory_footprint(void) {
+  MemoryFootprint footprint;
+  read_memory_footprint(&footprint);
+
+  const struct {
+    const char *name;
+    gint64 kb;
+  } rows[] = {{"heap", footprint.heap_kb},
+              {"stacks", footprint.stacks_kb},
+              {"textures", footprint.textures_kb},
+              {"libs", footprint.libraries_kb},
+              {"other", footprint.other_kb},
+              {"total", footprint.total_kb}};
+
+  g_printerr(" memory (RSS%s)\n", low_memory_mode ? ", low-memory mode" : "");
+  for (size_t i = 0; i < G_N_ELEMENTS(rows); i++) {
+    gchar *size = g_format_size((guint64)rows[i].kb * 1024);
+    g_printerr("  %-8s %s\n", rows[i].name, size);
+    g_free(size);
+  }
+}
 
-      if (temp != NULL && (wdata->previous_temp == NULL ||
-                           strcmp(wdata->previous_temp, temp) != 0)) {
-        temp_changed = TRUE;
-        g_free(wdata->previous_temp);
-        wdata->previous_temp = g_strdup(temp);
-      }
+// Dump all runtime statistics to stderr
+static void print_runtime_stats(void) {
+  g_printerr("desktop-thingy runtime stats\n");
+  g_printerr(" modules (latency from command output, command resource use)\n");
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++)
+    print_module_stats(&bar_module_stats[i]);
+  print_module_stats(&weather_module_stats);
+  print_module_stats(&date_module_stats);
+
+  g_printerr(" frame timing\n");
+  print_window_stats(&background_window_stats);
+  print_window_stats(&day_text_window_stats);
+  print_window_stats(&bar_window_stats);
+
+  g_printerr(" startup\n");
+  // Compare the first paints below against a --no-font-warmup run to see
+  // what the warm-up is worth
+  if (!font_warmup_enabled) {
+    g_printerr("  fonts    warm-up off\n");
+  } else if (font_warmup.duration > 0) {
+    g_printerr("  fonts    warm-up=%.2fms waited=%.2fms\n",
+               font_warmup.duration / 1000.0, font_warmup.waited / 1000.0);
+  }
+  print_first_paint(&background_window_stats);
+  print_first_paint(&day_text_window_stats);
+  print_first_paint(&bar_window_stats);
 
-      if (emoji_changed || temp_changed) {
-        GtkWidget *emoji_widget = wdata->emoji_widget;
-        GtkWidget *temp_widget = wdata->temp_widget;
+  print_memory_footprint();
+}
 
-        WeatherUpdateData *update_data = g_malloc(sizeof(WeatherUpdateData));
-        update_data->emoji_widget = emoji_widget;
-        update_data->temp_widget = temp_widget;
-        update_data->new_emoji =
-            emoji_changed && emoji ? g_strdup(emoji) : NULL;
-        update_data->new_temp = temp_changed && temp ? g_strdup(temp) : NULL;
+// Give freed memory back to the kernel after a burst of allocations
+static void trim_heap(const char *reason) {
+  if (!low_memory_mode)
+    return;
 
-        g_mutex_unlock(&wdata->mutex);
+  TRACE_BEGIN("malloc_trim", reason);
+  malloc_trim(0);
+  TRACE_END("malloc_trim");
+}
 
-        g_idle_add(update_weather_ui_from_main_thread, update_data);
-      } else {
-        g_mutex_unlock(&wdata->mutex);
-      }
+// Idle callback once startup work is done: trim what it left behind and
+// report the footprint in low-memory mode
+static gboolean on_startup_settled(gpointer user_data) {
+  (void)user_data;
 
-      g_free(emoji);
-      g_free(temp);
-    }
+  trim_heap("startup");
+  if (low_memory_mode) {
+    g_printerr("desktop-thingy memory after startup\n");
+    print_memory_footprint();
   }
+  return G_SOURCE_REMOVE;
+}
 
-  // Mark thread as no longer running
-  g_mutex_lock(&wdata->mutex);
-  wdata->thread_running = FALSE;
-  g_cond_signal(&wdata->cond);
-  g_mutex_unlock(&wdata->mutex);
+// Cap malloc arenas at LOW_MEMORY_ARENAS. Must run before any thread is
+// created; worker stacks are sized by new_worker_thread.
+static void apply_low_memory_mode(void) {
+  if (!low_memory_mode)
+    return;
 
-  return NULL;
+  mallopt(M_ARENA_MAX, LOW_MEMORY_ARENAS);
 }
 
-// Date worker thread function: polls at interval and signals main thread on
-// change
-static gpointer date_worker_thread(gpointer user_data) {
-  DateData *ddata = (DateData *)user_data;
+typedef struct {
+  const char *name;
+  GThreadFunc func;
+  gpointer data;
+} WorkerStart;
+
+static gpointer run_named_worker(gpointer user_data) {
+  WorkerStart start = *(WorkerStart *)user_data;
+  g_free(user_data);
+
+  char name[16]; // Thread names are limited to 15 characters
+  g_strlcpy(name, start.name, sizeof(name));
+  pthread_setname_np(pthread_self(), name);
+  return start.func(start.data);
+}
 
-  // Mark thread as running
-  g_mutex_lock(&ddata->mutex);
-  ddata->thread_running = TRUE;
-  g_mutex_unlock(&ddata->mutex);
+// Start one of the module, date or weather workers. In low-memory mode they
+// get LOW_MEMORY_STACK_SIZE stacks; threads started by GLib, GIO or the
+// graphics stack keep the default size. Only GLib's deprecated
+// g_thread_create_full() takes a stack size, and it drops the thread name,
+// so the worker names itself.
+static GThread *new_worker_thread(const char *name, GThreadFunc func,
+                                  gpointer data, GError **error) {
+  if (!low_memory_mode)
+    return g_thread_try_new(name, func, data, error);
+
+  WorkerStart *start = g_new(WorkerStart, 1);
+  *start = (WorkerStart){name, func, data};
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+  GThread *thread =
+      g_thread_create_full(run_named_worker, start, LOW_MEMORY_STACK_SIZE,
+                           TRUE, FALSE, G_THREAD_PRIORITY_NORMAL, error);
+  G_GNUC_END_IGNORE_DEPRECATIONS
+  if (thread == NULL)
+    g_free(start);
+  return thread;
+}
 
-  // Helper function to get current date strings
-  // Initial update
-  time_t rawtime;
-  struct tm *timeinfo;
-  char day_name[32];
-  char month_name[32];
-  char day_number[8];
+static gboolean on_stats_signal(gpointer user_data) {
+  (void)user_data;
+  print_runtime_stats();
+  return G_SOURCE_CONTINUE;
+}
 
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  strftime(day_name, sizeof(day_name), "%A", timeinfo);
-  strftime(month_name, sizeof(month_name), "%B", timeinfo);
-  strftime(day_number, sizeof(day_number), "%d", timeinfo);
+static void free_window_stats(WindowStats *stats) {
+  if (stats->pending != NULL) {
+    g_array_free(stats->pending, TRUE);
+    g_array_free(stats->awaiting, TRUE);
+    stats->pending = NULL;
+    stats->awaiting = NULL;
+  }
+}
 
-  // Convert to uppercase
-  for (int i = 0; day_name[i]; i++) {
-    day_name[i] = g_ascii_toupper(day_name[i]);
+// Look up the approximate character width of a label's font, measuring it
+// only the first time each font is seen
+static int get_char_width(GtkWidget *widget) {
+  PangoContext *context = gtk_widget_get_pango_context(widget);
+  const PangoFontDescription *font =
+      pango_context_get_font_description(context);
+  gchar *key = pango_font_description_to_string(font);
+
+  if (char_width_cache == NULL) {
+    char_width_cache =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   }
-  for (int i = 0; month_name[i]; i++) {
-    month_name[i] = g_ascii_toupper(month_name[i]);
+
+  gpointer cached = g_hash_table_lookup(char_width_cache, key);
+  if (cached != NULL) {
+    g_free(key);
+    return GPOINTER_TO_INT(cached);
   }
 
-  gchar *day = g_strdup(day_name);
-  gchar *month = g_strdup(month_name);
-  gchar *day_num = g_strdup(day_number);
+  // Same estimate GtkLabel uses for width-chars
+  PangoFontMetrics *metrics = pango_context_get_metrics(context, font, NULL);
+  int width =
+      MAX(pango_font_metrics_get_approximate_char_width(metrics),
+          pango_font_metrics_get_approximate_digit_width(metrics));
+  pango_font_metrics_unref(metrics);
+  width = MAX((width + PANGO_SCALE - 1) / PANGO_SCALE, 1);
 
-  if (day != NULL || month != NULL || day_num != NULL) {
-    g_mutex_lock(&ddata->mutex);
-    if (day != NULL)
-      ddata->previous_day = g_strdup(day);
-    if (month != NULL)
-      ddata->previous_month = g_strdup(month);
-    if (day_num != NULL)
-      ddata->previous_day_number = g_strdup(day_num);
+  g_hash_table_insert(char_width_cache, key, GINT_TO_POINTER(width));
+  return width;
+}
 
-    GtkWidget *day_widget = ddata->day_widget;
-    GtkWidget *month_widget = ddata->month_widget;
-    GtkWidget *day_number_widget = ddata->day_number_widget;
-    g_mutex_unlock(&ddata->mutex);
+// Set a label's text, tracing the call under the given (static) name
+static void set_label_text(GtkWidget *widget, const gchar *text,
+                           const char *name) {
+  gint64 start_time = TRACE_NOW();
+  gtk_label_set_text(GTK_LABEL(widget), text);
+  TRACE('X', "gtk_label_set_text", name, start_time,
+        g_get_monotonic_time() - start_time, NULL, 0);
+}
 
-    DateUpdateData *update_data = g_malloc(sizeof(DateUpdateData));
-    update_data->day_widget = day_widget;
-    update_data->month_widget = month_widget;
-    update_data->day_number_widget = day_number_widget;
-    update_data->new_day = day ? g_strdup(day) : NULL;
-    update_data->new_month = month ? g_strdup(month) : NULL;
-    update_data->new_day_number = day_num ? g_strdup(day_num) : NULL;
-    g_idle_add(update_date_ui_from_main_thread, update_data);
+// Tooltip backed by a command that only runs while the pointer is over the
+// widget. Everything here lives on the main thread.
+typedef struct {
+  GtkWidget *widget;
+  const char *command;
+  gchar *text;               // Last output, shown as the tooltip
+  gint64 fetched;            // Monotonic time text was produced
+  GSubprocess *process;      // Running command, if any
+  GCancellable *cancellable; // Cancels the running command on leave
+} DetailData;
+
+static void on_detail_command_done(GObject *source, GAsyncResult *result,
+                                   gpointer user_data) {
+  GSubprocess *process = G_SUBPROCESS(source);
+  gchar *output = NULL;
+  GError *error = NULL;
 
-    g_free(day);
-    g_free(month);
-    g_free(day_num);
+  if (!g_subprocess_communicate_utf8_finish(process, result, &output, NULL,
+                                            &error)) {
+    // A cancelled run may belong to a widget that is already gone
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_printerr("Detail command failed: %s\n", error->message);
+    g_error_free(error);
+    g_object_unref(process);
+    return;
   }
 
-  // Poll at date update interval
-  while (TRUE) {
-    g_mutex_lock(&ddata->mutex);
+  DetailData *detail = user_data;
+  g_clear_object(&detail->process);
+  g_clear_object(&detail->cancellable);
+  g_object_unref(process);
 
-    // Wait for interval or stop signal
-    gint64 end_time =
-        g_get_monotonic_time() + (DATE_UPDATE_INTERVAL * 1000); // microseconds
+  g_free(detail->text);
+  detail->text = g_strchomp(output != NULL ? output : g_strdup(""));
+  detail->fetched = g_get_monotonic_time();
+  gtk_widget_set_tooltip_text(detail->widget, detail->text);
+  TRACE_INSTANT("detail_ready", detail->command);
+}
 
-    while (!ddata->should_stop) {
-      if (!g_cond_wait_until(&ddata->cond, &ddata->mutex, end_time)) {
-        break;
-      }
-      if (ddata->should_stop)
-        break;
-    }
+static void on_detail_enter(GtkEventControllerMotion *controller, double x,
+                            double y, gpointer user_data) {
+  (void)controller;
+  (void)x;
+  (void)y;
+  DetailData *detail = user_data;
 
-    if (ddata->should_stop) {
-      g_mutex_unlock(&ddata->mutex);
-      break;
-    }
-    g_mutex_unlock(&ddata->mutex);
+  if (detail->process != NULL ||
+      (detail->text != NULL &&
+       g_get_monotonic_time() - detail->fetched <= DETAIL_CACHE_TTL * 1000))
+    return;
 
-    // Get new date data
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    strftime(day_name, sizeof(day_name), "%A", timeinfo);
-    strftime(month_name, sizeof(month_name), "%B", timeinfo);
-    strftime(day_number, sizeof(day_number), "%d", timeinfo);
+  GError *error = NULL;
+  detail->process = g_subprocess_new(
+      G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_SILENCE,
+      &error, "/bin/sh", "-c", detail->command, NULL);
+  if (detail->process == NULL) {
+    g_printerr("Failed to run detail command: %s\n", error->message);
+    g_error_free(error);
+    return;
+  }
 
-    // Convert to uppercase
-    for (int i = 0; day_name[i]; i++) {
-      day_name[i] = g_ascii_toupper(day_name[i]);
-    }
+  TRACE_INSTANT("detail_command", detail->command);
+  detail->cancellable = g_cancellable_new();
+  g_subprocess_communicate_utf8_async(g_object_ref(detail->process), NULL,
+                                      detail->cancellable,
+                                      on_detail_command_done, detail);
+}
+
+// Stop a detail command that is still running
+static void cancel_detail_command(DetailData *detail) {
+  if (detail->process == NULL)
+    return;
+
+  g_cancellable_cancel(detail->cancellable);
+  g_subprocess_force_exit(detail->process);
+  g_clear_object(&detail->process);
+  g_clear_object(&detail->cancellable);
+}
+
+static void on_detail_leave(GtkEventControllerMotion *controller,
+                            gpointer user_data) {
+  (void)controller;
+  cancel_detail_command(user_data);
+}
+
+static void free_detail_data(gpointer data) {
+  DetailData *detail = data;
+  cancel_detail_command(detail);
+  g_free(detail->text);
+  g_free(detail);
+}
+
+// Show the output of command as the widget's tooltip, run lazily on hover
+// and reused for DETAIL_CACHE_TTL
+static void attach_detail_command(GtkWidget *widget, const char *command) {
+  DetailData *detail = g_new0(DetailData, 1);
+  detail->widget = widget;
+  detail->command = command;
+  g_object_set_data_full(G_OBJECT(widget), "detail", detail,
+                         free_detail_data);
+
+  GtkEventController *motion = gtk_event_controller_motion_new();
+  g_signal_connect(motion, "enter", G_CALLBACK(on_detail_enter), detail);
+  g_signal_connect(motion, "leave", G_CALLBACK(on_detail_leave), detail);
+  gtk_widget_add_controller(widget, motion);
+  gtk_widget_set_has_tooltip(widget, TRUE);
+}
+
+// Text attributes selected by SGR codes; colours are 0xRRGGBB, -1 for the
+// label's own
+typedef struct {
+  gint32 foreground;
+  gint32 background;
+  gboolean bold;
+  gboolean italic;
+  gboolean underline;
+} AnsiStyle;
+
+static const AnsiStyle ansi_default_style = {-1, -1, FALSE, FALSE, FALSE};
+
+static gint32 get_ansi_color(int index) {
+  if (index < 16) {
+    guint r = 0, g = 0, b = 0;
+    sscanf(ANSI_COLORS[index], "#%02x%02x%02x", &r, &g, &b);
+    return (gint32)(r << 16 | g << 8 | b);
+  }
+  if (index < 232) {
+    static const int levels[] = {0, 95, 135, 175, 215, 255};
+    index -= 16;
+    return levels[index / 36] << 16 | levels[index / 6 % 6] << 8 |
+           levels[index % 6];
+  }
+  int gray = 8 + (index - 232) * 10;
+  return gray << 16 | gray << 8 | gray;
+}
+
+static void insert_ansi_attr(PangoAttrList *attrs, PangoAttribute *attr,
+                             guint start, guint end) {
+  attr->start_index = start;
+  attr->end_index = end;
+  pango_attr_list_insert(attrs, attr);
+}
+
+// Emit attributes for the text written in a style, [start, end)
+static gboolean flush_ansi_style(PangoAttrList *attrs, const AnsiStyle *style,
+                                 guint start, guint end) {
+  if (end <= start || memcmp(style, &ansi_default_style, sizeof(*style)) == 0)
+    return FALSE;
+
+  if (style->foreground >= 0)
+    insert_ansi_attr(attrs,
+                     pango_attr_foreground_new(
+                         (style->foreground >> 16 & 0xff) * 257,
+                         (style->foreground >> 8 & 0xff) * 257,
+                         (style->foreground & 0xff) * 257),
+                     start, end);
+  if (style->background >= 0)
+    insert_ansi_attr(attrs,
+                     pango_attr_background_new(
+                         (style->background >> 16 & 0xff) * 257,
+                         (style->background >> 8 & 0xff) * 257,
+                         (style->background & 0xff) * 257),
+                     start, end);
+  if (style->bold)
+    insert_ansi_attr(attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD), start,
+                     end);
+  if (style->italic)
+    insert_ansi_attr(attrs, pango_attr_style_new(PANGO_STYLE_ITALIC), start,
+                     end);
+  if (style->underline)
+    insert_ansi_attr(attrs, pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
+                     start, end);
+  return TRUE;
+}
+
+// Extended colour after 38/48: "5;N" or "2;R;G;B". Returns the number of
+// parameters used.
+static int parse_ansi_extended_color(const int *params, int count,
+                                     gint32 *color) {
+  if (count >= 2 && params[0] == 5) {
+    *color = get_ansi_color(CLAMP(params[1], 0, 255));
+    return 2;
+  }
+  if (count >= 4 && params[0] == 2) {
+    *color = CLAMP(params[1], 0, 255) << 16 | CLAMP(params[2], 0, 255) << 8 |
+             CLAMP(params[3], 0, 255);
+    return 4;
+  }
+  return count;
+}
+
+static void apply_ansi_sgr(AnsiStyle *style, const int *params, int count) {
+  if (count == 0) {
+    *style = ansi_default_style;
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    int code = params[i];
+    if (code == 0)
+      *style = ansi_default_style;
+    else if (code == 1)
+      style->bold = TRUE;
+    else if (code == 3)
+      style->italic = TRUE;
+    else if (code == 4)
+      style->underline = TRUE;
+    else if (code == 22)
+      style->bold = FALSE;
+    else if (code == 23)
+      style->italic = FALSE;
+    else if (code == 24)
+      style->underline = FALSE;
+    else if (code >= 30 && code <= 37)
+      style->foreground = get_ansi_color(code - 30);
+    else if (code >= 90 && code <= 97)
+      style->foreground = get_ansi_color(code - 90 + 8);
+    else if (code == 39)
+      style->foreground = -1;
+    else if (code >= 40 && code <= 47)
+      style->background = get_ansi_color(code - 40);
+    else if (code >= 100 && code <= 107)
+      style->background = get_ansi_color(code - 100 + 8);
+    else if (code == 49)
+      style->background = -1;
+    else if (code == 38)
+      i += parse_ansi_extended_color(params + i + 1, count - i - 1,
+                                     &style->foreground);
+    else if (code == 48)
+      i += parse_ansi_extended_color(params + i + 1, count - i - 1,
+                                     &style->background);
+  }
+}
+
+#define ANSI_MAX_PARAMS 16
+
+// Single pass over module output: SGR sequences become Pango attributes,
+// other escape sequences are dropped and invalid UTF-8 becomes U+FFFD
+static AnsiText *parse_ansi_text(const gchar *raw) {
+  GString *text = g_string_sized_new(strlen(raw));
+  PangoAttrList *attrs = pango_attr_list_new();
+  gboolean has_attrs = FALSE;
+  AnsiStyle style = ansi_default_style;
+  guint style_start = 0;
+
+  const gchar *p = raw;
+  while (*p != '\0') {
+    if (*p == '\033') {
+      if (p[1] == '[') {
+        // CSI: parameters, intermediates, then one final byte
+        int params[ANSI_MAX_PARAMS];
+        int count = 0;
+        gboolean plain = TRUE; // Only digits and ';', as SGR uses
+        const gchar *q = p + 2;
+        if (*q >= '0' && *q <= '?')
+          params[count++] = 0;
+        for (; *q >= 0x20 && *q <= 0x3f; q++) {
+          if (*q >= '0' && *q <= '9' && count > 0)
+            params[count - 1] =
+                MIN(params[count - 1] * 10 + (*q - '0'), 65535);
+          else if (*q == ';' && count < ANSI_MAX_PARAMS)
+            params[count++] = 0;
+          else if (*q != ';')
+            plain = FALSE;
+        }
+
+        if (*q == 'm' && plain) {
+          has_attrs |= flush_ansi_style(attrs, &style, style_start, text->len);
+          apply_ansi_sgr(&style, params, count);
+          style_start = text->len;
+        }
+        p = (*q >= 0x40 && *q <= 0x7e) ? q + 1 : q;
+      } else if (p[1] == ']') {
+        // OSC (window titles, hyperlinks): up to BEL or ESC backslash
+        const gchar *q = p + 2;
+        while (*q != '\0' && *q != '\a' &&
+               !(q[0] == '\033' && q[1] == '\\'))
+          q++;
+        p = *q == '\0' ? q : q + (*q == '\a' ? 1 : 2);
+      } else {
+        p += p[1] != '\0' ? 2 : 1;
+      }
+      continue;
+    }
+
+    gunichar c = g_utf8_get_char_validated(p, -1);
+    if (c == (gunichar)-1 || c == (gunichar)-2) {
+      g_string_append_unichar(text, 0xFFFD);
+      p++;
+    } else {
+      const gchar *next = g_utf8_next_char(p);
+      g_string_append_len(text, p, next - p);
+      p = next;
+    }
+  }
+  has_attrs |= flush_ansi_style(attrs, &style, style_start, text->len);
+
+  AnsiText *parsed = g_new0(AnsiText, 1);
+  parsed->text = g_string_free(text, FALSE);
+  if (has_attrs)
+    parsed->attrs = attrs;
+  else
+    pango_attr_list_unref(attrs);
+  return parsed;
+}
+
+static void free_ansi_text(gpointer data) {
+  AnsiText *parsed = data;
+  g_free(parsed->text);
+  if (parsed->attrs != NULL)
+    pango_attr_list_unref(parsed->attrs);
+  g_free(parsed);
+}
+
+// Parsed form of an output, reused while the same output keeps coming back
+static const AnsiText *get_ansi_text(const gchar *raw) {
+  if (ansi_text_cache == NULL)
+    ansi_text_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            free_ansi_text);
+
+  AnsiText *parsed = g_hash_table_lookup(ansi_text_cache, raw);
+  if (parsed == NULL) {
+    if (g_hash_table_size(ansi_text_cache) >= ANSI_TEXT_CACHE_SIZE)
+      g_hash_table_remove_all(ansi_text_cache);
+    parsed = parse_ansi_text(raw);
+    g_hash_table_insert(ansi_text_cache, g_strdup(raw), parsed);
+  }
+  return parsed;
+}
+
+// Show module output on a bar label. Plain valid UTF-8 goes straight to the
+// label; anything with escapes or invalid bytes is parsed once and cached.
+static void set_bar_label_output(GtkWidget *widget, const gchar *text,
+                                 const char *name) {
+  if (strchr(text, '\033') == NULL && g_utf8_validate(text, -1, NULL)) {
+    if (gtk_label_get_attributes(GTK_LABEL(widget)) != NULL)
+      gtk_label_set_attributes(GTK_LABEL(widget), NULL);
+    set_label_text(widget, text, name);
+    return;
+  }
+
+  const AnsiText *parsed = get_ansi_text(text);
+  gtk_label_set_attributes(GTK_LABEL(widget), parsed->attrs);
+  set_label_text(widget, parsed->text, name);
+}
+
+// Set a bar label's text, keeping its size request stable according to the
+// item's width policy so unrelated siblings are not pushed around
+static void set_bar_label_text(GtkWidget *widget, const gchar *text) {
+  BarItemData *item_data = g_object_get_data(G_OBJECT(widget), "bar-item");
+
+  set_bar_label_output(widget, text, item_data ? item_data->command : NULL);
+
+  if (item_data == NULL || item_data->width_policy == BAR_WIDTH_NATURAL)
+    return;
+
+  // Start over if the font changed since the size request was computed
+  int char_px = get_char_width(widget);
+  if (char_px != item_data->width_char_px) {
+    item_data->width_char_px = char_px;
+    item_data->width_px = 0;
+  }
+
+  int max_px = item_data->width_chars > 0 ? item_data->width_chars * char_px
+                                          : G_MAXINT;
+  int width_px = item_data->width_px;
+
+  if (item_data->width_policy == BAR_WIDTH_FIXED) {
+    width_px = max_px;
+  } else {
+    // Grow-only: never hand width back once a longer text has been seen
+    int natural = 0;
+    gtk_widget_measure(widget, GTK_ORIENTATION_HORIZONTAL, -1, NULL, &natural,
+                       NULL, NULL);
+    width_px = MAX(width_px, MIN(natural, max_px));
+  }
+
+  if (width_px != item_data->width_px) {
+    item_data->width_px = width_px;
+    gtk_widget_set_size_request(widget, width_px, -1);
+  }
+}
+
+// Backend socket (--serve). Each client gets the latest value of every
+// module on connect and then one "id<TAB>value" line per change, with the
+// value escaped by g_strescape. Clients only read.
+typedef struct {
+  int fd;
+  guint source_id;
+} ModuleClient;
+
+static int module_server_fd = -1;
+static guint module_server_source_id = 0;
+static GPtrArray *module_clients = NULL;   // ModuleClient
+static GHashTable *published_values = NULL; // id -> latest value
+
+// Frontend connection (--connect)
+static int module_client_fd = -1;
+static guint module_client_source_id = 0;
+static guint module_reconnect_id = 0;
+static GString *module_client_buffer = NULL;
+static GHashTable *module_widgets = NULL; // id -> label
+
+#define MODULE_RECONNECT_INTERVAL 2000 // Milliseconds between attempts
+
+static gchar *get_socket_path(void) {
+  if (socket_path != NULL)
+    return g_strdup(socket_path);
+  return g_build_filename(g_get_user_runtime_dir(), "desktop-thingy.sock",
+                          NULL);
+}
+
+static gchar *format_module_line(const char *id, const gchar *value) {
+  gchar *escaped = g_strescape(value, NULL);
+  gchar *line = g_strdup_printf("%s\t%s\n", id, escaped);
+  g_free(escaped);
+  return line;
+}
+
+static void remove_module_client(ModuleClient *client) {
+  g_source_remove(client->source_id);
+  close(client->fd);
+  g_ptr_array_remove(module_clients, client);
+}
+
+// Send a whole line or give up on the client; one that cannot keep up
+// reconnects and gets a fresh snapshot
+static gboolean send_module_line(ModuleClient *client, const gchar *line) {
+  size_t length = strlen(line);
+  ssize_t sent = send(client->fd, line, length, MSG_NOSIGNAL);
+  return sent == (ssize_t)length;
+}
+
+static gboolean on_module_client_event(gint fd, GIOCondition condition,
+                                       gpointer user_data) {
+  ModuleClient *client = user_data;
+  char buffer[256];
+
+  // Clients never send anything; readable means closed
+  if ((condition & (G_IO_HUP | G_IO_ERR)) ||
+      recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) <= 0) {
+    client->source_id = 0;
+    close(client->fd);
+    g_ptr_array_remove(module_clients, client);
+    return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_module_server_accept(gint fd, GIOCondition condition,
+                                        gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  int client_fd;
+  while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+         0) {
+    ModuleClient *client = g_new0(ModuleClient, 1);
+    client->fd = client_fd;
+    client->source_id = g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP,
+                                      on_module_client_event, client);
+    g_ptr_array_add(module_clients, client);
+
+    // Bring the new frontend up to date
+    GHashTableIter iter;
+    gpointer id, value;
+    g_hash_table_iter_init(&iter, published_values);
+    while (g_hash_table_iter_next(&iter, &id, &value)) {
+      gchar *line = format_module_line(id, value);
+      gboolean ok = send_module_line(client, line);
+      g_free(line);
+      if (!ok) {
+        remove_module_client(client);
+        break;
+      }
+    }
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void free_module_client(gpointer data) { g_free(data); }
+
+// Listen for frontends; a stale socket left by a dead backend is replaced
+static gboolean start_module_server(void) {
+  gchar *path = get_socket_path();
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    g_printerr("Socket path too long: %s\n", path);
+    g_free(path);
+    return FALSE;
+  }
+  g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0 &&
+      bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 &&
+      errno == EADDRINUSE) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    gboolean alive =
+        connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+    close(probe);
+    if (alive) {
+      g_printerr("Another backend is already serving %s\n", path);
+      close(fd);
+      g_free(path);
+      return FALSE;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0 || listen(fd, 16) != 0) {
+    g_printerr("Failed to listen on %s: %s\n", path, g_strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    g_free(path);
+    return FALSE;
+  }
+  g_free(path);
+
+  module_server_fd = fd;
+  module_clients = g_ptr_array_new_with_free_func(free_module_client);
+  published_values =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  module_server_source_id =
+      g_unix_fd_add(fd, G_IO_IN, on_module_server_accept, NULL);
+  return TRUE;
+}
+
+static void stop_module_server(void) {
+  if (module_server_fd < 0)
+    return;
+
+  while (module_clients->len > 0)
+    remove_module_client(g_ptr_array_index(module_clients, 0));
+  g_ptr_array_unref(module_clients);
+  module_clients = NULL;
+  g_hash_table_destroy(published_values);
+  published_values = NULL;
+
+  g_source_remove(module_server_source_id);
+  module_server_source_id = 0;
+  close(module_server_fd);
+  module_server_fd = -1;
+
+  gchar *path = get_socket_path();
+  unlink(path);
+  g_free(path);
+}
+
+// Remember a value and send it to every connected frontend
+static void broadcast_module_value(const char *id, const gchar *value) {
+  g_hash_table_replace(published_values, g_strdup(id), g_strdup(value));
+
+  gchar *line = format_module_line(id, value);
+  for (guint i = 0; i < module_clients->len;) {
+    ModuleClient *client = g_ptr_array_index(module_clients, i);
+    if (send_module_line(client, line))
+      i++;
+    else
+      remove_module_client(client);
+  }
+  g_free(line);
+}
+
+// Remember which label shows a module id so a frontend (--connect) can
+// route backend updates to it
+static void register_module_widget(const char *id, GtkWidget *widget) {
+  if (!connect_mode)
+    return;
+  if (module_widgets == NULL)
+    module_widgets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL);
+  g_hash_table_replace(module_widgets, g_strdup(id), widget);
+}
+
+static void apply_module_line(const gchar *line) {
+  const gchar *tab = strchr(line, '\t');
+  if (tab == NULL)
+    return;
+
+  gchar *id = g_strndup(line, tab - line);
+  GtkWidget *widget = g_hash_table_lookup(module_widgets, id);
+  if (widget != NULL) {
+    gchar *value = g_strcompress(tab + 1);
+    if (g_str_has_prefix(id, "bar."))
+      set_bar_label_text(widget, value);
+    else
+      set_label_text(widget, value, "module-client");
+    g_free(value);
+  }
+  g_free(id);
+}
+
+static gboolean connect_module_server(gpointer user_data);
+
+static gboolean on_module_server_data(gint fd, GIOCondition condition,
+                                      gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  char buffer[4096];
+  ssize_t length;
+  while ((length = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+    g_string_append_len(module_client_buffer, buffer, length);
+
+  // Apply every complete line and keep the partial tail for later
+  gchar *start = module_client_buffer->str;
+  gchar *newline;
+  while ((newline = strchr(start, '\n')) != NULL) {
+    *newline = '\0';
+    apply_module_line(start);
+    start = newline + 1;
+  }
+  g_string_erase(module_client_buffer, 0, start - module_client_buffer->str);
+
+  if (length == 0 || (length < 0 && errno != EAGAIN && errno != EINTR)) {
+    // Backend went away; keep the last values and wait for it to return
+    close(module_client_fd);
+    module_client_fd = -1;
+    module_client_source_id = 0;
+    g_string_truncate(module_client_buffer, 0);
+    module_reconnect_id = g_timeout_add(MODULE_RECONNECT_INTERVAL,
+                                        connect_module_server, NULL);
+    return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+// Subscribe to the backend, retrying until it is up
+static gboolean connect_module_server(gpointer user_data) {
+  (void)user_data;
+
+  gchar *path = get_socket_path();
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+  g_free(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    if (fd >= 0)
+      close(fd);
+    if (module_reconnect_id == 0)
+      module_reconnect_id = g_timeout_add(MODULE_RECONNECT_INTERVAL,
+                                          connect_module_server, NULL);
+    return G_SOURCE_CONTINUE;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  module_client_fd = fd;
+  if (module_client_buffer == NULL)
+    module_client_buffer = g_string_new(NULL);
+  module_client_source_id =
+      g_unix_fd_add(fd, G_IO_IN | G_IO_HUP, on_module_server_data, NULL);
+
+  module_reconnect_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void stop_module_client(void) {
+  if (module_reconnect_id != 0) {
+    g_source_remove(module_reconnect_id);
+    module_reconnect_id = 0;
+  }
+  if (module_client_source_id != 0) {
+    g_source_remove(module_client_source_id);
+    module_client_source_id = 0;
+  }
+  if (module_client_fd >= 0) {
+    close(module_client_fd);
+    module_client_fd = -1;
+  }
+  if (module_client_buffer != NULL) {
+    g_string_free(module_client_buffer, TRUE);
+    module_client_buffer = NULL;
+  }
+  if (module_widgets != NULL) {
+    g_hash_table_destroy(module_widgets);
+    module_widgets = NULL;
+  }
+}
+
+// Write one module change to stdout as a JSON line (--headless)
+static void print_module_update(const char *id, const gchar *value) {
+  GString *line = g_string_new("{\"id\":");
+  append_json_string(line, id);
+  g_string_append_printf(line, ",\"ts\":%" G_GINT64_FORMAT ",\"value\":",
+                         g_get_real_time() / 1000);
+  append_json_string(line, value);
+  g_string_append(line, "}\n");
+
+  fwrite(line->str, 1, line->len, stdout);
+  fflush(stdout);
+  g_string_free(line, TRUE);
+}
+
+// Hand a module change to the consumers that replace the windows
+static void emit_module_update(const char *id, const gchar *value) {
+  if (headless_mode)
+    print_module_update(id, value);
+  if (module_server_fd >= 0)
+    broadcast_module_value(id, value);
+}
+
+// Show a new value for one dashboard label, or print it when headless
+static void publish_label_update(GtkWidget *widget, const char *id,
+                                 const gchar *text, ModuleStats *stats,
+                                 gint64 ready_time) {
+  if (text == NULL)
+    return;
+
+  if (engine_only) {
+    emit_module_update(id, text);
+  } else if (widget != NULL) {
+    set_label_text(widget, text, id);
+    track_frame_update(widget, stats, ready_time);
+  }
+}
+
+// Idle callback to update UI from main thread (called when worker thread
+// signals)
+static gboolean update_ui_from_main_thread(gpointer user_data) {
+  UpdateData *update_data = (UpdateData *)user_data;
+  const char *module = update_data->stats ? update_data->stats->name : NULL;
+  TRACE_BEGIN("idle_update", module);
+  USDT(idle_dispatch, update_data->id, update_data->ready_time);
+
+  if (update_data->stats != NULL) {
+    record_latency(&update_data->stats->queue,
+                   g_get_monotonic_time() - update_data->ready_time);
+  }
+
+  if (engine_only) {
+    emit_module_update(update_data->id, update_data->new_output);
+  } else if (update_data->widget != NULL && update_data->new_output != NULL) {
+    set_bar_label_text(update_data->widget, update_data->new_output);
+    track_frame_update(update_data->widget, update_data->stats,
+                       update_data->ready_time);
+  }
+
+  // Free the update data
+  g_free(update_data->new_output);
+  g_free(update_data);
+
+  TRACE_END("idle_update");
+  return G_SOURCE_REMOVE; // Remove the idle source after execution
+}
+
+// Idle callback to update weather UI from main thread
+static gboolean update_weather_ui_from_main_thread(gpointer user_data) {
+  WeatherUpdateData *update_data = (WeatherUpdateData *)user_data;
+  TRACE_BEGIN("idle_update", "weather");
+  USDT(idle_dispatch, "weather", update_data->ready_time);
+
+  record_latency(&weather_module_stats.queue,
+                 g_get_monotonic_time() - update_data->ready_time);
+
+  publish_label_update(update_data->emoji_widget, "weather.emoji",
+                       update_data->new_emoji, &weather_module_stats,
+                       update_data->ready_time);
+  publish_label_update(update_data->temp_widget, "weather.temp",
+                       update_data->new_temp, &weather_module_stats,
+                       update_data->ready_time);
+
+  // Free the update data
+  g_free(update_data->new_emoji);
+  g_free(update_data->new_temp);
+  g_free(update_data);
+
+  TRACE_END("idle_update");
+  return G_SOURCE_REMOVE;
+}
+
+// Idle callback to update date UI from main thread
+static gboolean update_date_ui_from_main_thread(gpointer user_data) {
+  DateUpdateData *update_data = (DateUpdateData *)user_data;
+  TRACE_BEGIN("idle_update", "date");
+  USDT(idle_dispatch, "date", update_data->ready_time);
+
+  record_latency(&date_module_stats.queue,
+                 g_get_monotonic_time() - update_data->ready_time);
+
+  publish_label_update(update_data->day_widget, "date.day",
+                       update_data->new_day, &date_module_stats,
+                       update_data->ready_time);
+  publish_label_update(update_data->month_widget, "date.month",
+                       update_data->new_month, &date_module_stats,
+                       update_data->ready_time);
+  publish_label_update(update_data->day_number_widget, "date.day_number",
+                       update_data->new_day_number, &date_module_stats,
+                       update_data->ready_time);
+  publish_label_update(update_data->agenda_widget, "date.agenda",
+                       update_data->new_agenda, &date_module_stats,
+                       update_data->ready_time);
+
+  // Free the update data
+  g_free(update_data->new_day);
+  g_free(update_data->new_month);
+  g_free(update_data->new_day_number);
+  g_free(update_data->new_agenda);
+  g_free(update_data);
+
+  TRACE_END("idle_update");
+  return G_SOURCE_REMOVE;
+}
+
+// Linux I/O priority encoding (see ioprio_set(2)); glibc has no wrapper
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+// Lower the worker thread's CPU and I/O priority. Scheduling attributes are
+// per thread on Linux and the commands it spawns inherit them.
+static void apply_module_priority(const BarItemData *item_data) {
+  pid_t tid = gettid();
+
+  if (item_data->nice != 0 &&
+      setpriority(PRIO_PROCESS, tid, item_data->nice) != 0) {
+    g_printerr("Failed to set nice %d for module %s: %s\n", item_data->nice,
+               item_data->command, g_strerror(errno));
+  }
+
+  if (item_data->priority == BAR_PRIORITY_IDLE) {
+    struct sched_param param = {0};
+    if (sched_setscheduler(tid, SCHED_IDLE, &param) != 0)
+      g_printerr("Failed to set SCHED_IDLE for module %s: %s\n",
+                 item_data->command, g_strerror(errno));
+  }
+
+  if (item_data->priority >= BAR_PRIORITY_IDLE_IO &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+              IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+    g_printerr("Failed to set idle I/O priority for module %s: %s\n",
+               item_data->command, g_strerror(errno));
+  }
+}
+
+// Read a file in place of running a command, without the trailing newline
+static gchar *read_module_file(const char *path) {
+  gchar *contents = NULL;
+  gsize length = 0;
+  if (!g_file_get_contents(path, &contents, &length, NULL))
+    return NULL;
+
+  if (length > 0 && contents[length - 1] == '\n')
+    contents[length - 1] = '\0';
+  return contents;
+}
+
+// Run a bar item's command, account its resource usage and stretch the
+// polling interval while the command uses more CPU than its budget allows.
+// Refreshes requested by signal never take a cached result.
+static gchar *run_module_command(BarItemData *item_data, gboolean refresh) {
+  // Share results with other modules running the same command, but never
+  // serve a module its own previous output
+  int max_age = refresh ? 0
+                        : MIN(COMMAND_CACHE_TTL,
+                              item_data->effective_interval / 2);
+
+  CommandUsage usage = {0};
+  gchar *output;
+  USDT(module_poll_start, item_data->id, item_data->command);
+  if (g_str_has_prefix(item_data->command, MODULE_FILE_PREFIX))
+    output = read_module_file(item_data->command +
+                              strlen(MODULE_FILE_PREFIX));
+  else
+    output = run_cached_command(item_data->command, max_age,
+                                item_data->shell, item_data->nice,
+                                item_data->priority, &usage);
+  USDT(module_poll_end, item_data->id, item_data->command, usage.cache_hits);
+  account_command_usage(item_data->stats, &usage);
+  output = apply_extractor(item_data->extract, output);
+
+  if (usage.runs == 0 || item_data->interval <= 0 ||
+      item_data->cpu_budget <= 0)
+    return output;
+
+  // Smooth over a few runs so one slow start doesn't stretch the interval
+  gint64 cpu_us = usage.user_us + usage.sys_us;
+  if (item_data->cpu_average_us == 0)
+    item_data->cpu_average_us = cpu_us;
+  else
+    item_data->cpu_average_us = (item_data->cpu_average_us * 3 + cpu_us) / 4;
+
+  // Shortest interval at which the average run stays within budget
+  gint64 needed = item_data->cpu_average_us * 100 / item_data->cpu_budget /
+                  1000;
+  int interval = (int)CLAMP(needed, item_data->interval,
+                            (gint64)item_data->interval * MODULE_MAX_STRETCH);
+
+  g_mutex_lock(&item_data->mutex);
+  gboolean changed = interval != item_data->effective_interval;
+  item_data->effective_interval = interval;
+  g_mutex_unlock(&item_data->mutex);
+
+  if (changed) {
+    TRACE_INSTANT("interval_stretch", item_data->command);
+    g_mutex_lock(&item_data->stats->usage_lock);
+    item_data->stats->stretched_interval =
+        interval > item_data->interval ? interval : 0;
+    g_mutex_unlock(&item_data->stats->usage_lock);
+  }
+
+  return output;
+}
+
+// End of a wait that started at start_time, stretched by the scheduling
+// profile. Workers recompute it when woken so profile switches apply to
+// the wait in progress.
+static gint64 get_scaled_deadline(gint64 start_time, int interval_ms) {
+  return start_time +
+         (gint64)interval_ms * g_atomic_int_get(&interval_scale) * 1000;
+}
+
+// Worker thread function: polls at module interval and signals main thread on
+// change
+static gpointer module_worker_thread(gpointer user_data) {
+  BarItemData *item_data = (BarItemData *)user_data;
+
+  // Mark thread as running
+  g_mutex_lock(&item_data->mutex);
+  item_data->thread_running = TRUE;
+  g_mutex_unlock(&item_data->mutex);
+
+  apply_module_priority(item_data);
+
+  // Initial update
+  gchar *output = run_module_command(item_data, FALSE);
+  gint64 ready_time = g_get_monotonic_time();
+  g_mutex_lock(&item_data->mutex);
+  item_data->previous_output = output ? g_strdup(output) : g_strdup("");
+  g_mutex_unlock(&item_data->mutex);
+
+  // Signal main thread to update UI (always update on initial run)
+  // Read widget pointer with mutex protection (though it's set during init
+  // and never modified)
+  g_mutex_lock(&item_data->mutex);
+  GtkWidget *widget = item_data->widget;
+  g_mutex_unlock(&item_data->mutex);
+
+  UpdateData *update_data = g_malloc(sizeof(UpdateData));
+  update_data->widget = widget;
+  update_data->id = item_data->id;
+  update_data->new_output = output ? g_strdup(output) : g_strdup("");
+  update_data->stats = item_data->stats;
+  update_data->ready_time = ready_time;
+  g_idle_add(update_ui_from_main_thread, update_data);
+
+  if (output != NULL) {
+    g_free(output);
+  }
+
+  // Poll at module's interval
+  while (TRUE) {
+    g_mutex_lock(&item_data->mutex);
+
+    // Wait for interval, refresh signal or stop signal (interruptible sleep)
+    gint64 wait_start = g_get_monotonic_time();
+
+    // Wait with timeout - will wake up on cond signal or timeout. Modules
+    // without an interval only run when their refresh signal arrives.
+    while (!item_data->should_stop && !item_data->refresh_requested) {
+      gint64 end_time =
+          get_scaled_deadline(wait_start, item_data->effective_interval);
+      if (item_data->interval <= 0) {
+        g_cond_wait(&item_data->cond, &item_data->mutex);
+      } else if (!g_cond_wait_until(&item_data->cond, &item_data->mutex,
+                                    end_time)) {
+        // Timeout occurred - break to execute command
+        break;
+      }
+    }
+
+    if (item_data->should_stop) {
+      g_mutex_unlock(&item_data->mutex);
+      break;
+    }
+    gboolean refresh = item_data->refresh_requested;
+    item_data->refresh_requested = FALSE;
+    g_mutex_unlock(&item_data->mutex);
+    TRACE_INSTANT("worker_wakeup", item_data->command);
+
+    // Execute command to get new output
+    output = run_module_command(item_data, refresh);
+    ready_time = g_get_monotonic_time();
+
+    g_mutex_lock(&item_data->mutex);
+
+    // Normalize blank output: treat NULL and empty string as blank
+    // Convert NULL to empty string for comparison
+    const char *current_output = (output == NULL) ? "" : output;
+    const char *previous_output =
+        (item_data->previous_output == NULL) ? "" : item_data->previous_output;
+
+    gboolean current_is_blank = (strlen(current_output) == 0);
+    gboolean previous_is_blank = (strlen(previous_output) == 0);
+
+    // Compare with previous output - signal if changed
+    // Skip update only if both are blank (no change from blank to blank)
+    gboolean should_update = FALSE;
+    if (current_is_blank && previous_is_blank) {
+      // Both blank - no change, skip update
+      should_update = FALSE;
+    } else {
+      // At least one is not blank - compare strings
+      should_update = (strcmp(previous_output, current_output) != 0);
+    }
+    USDT(module_change, item_data->id, (int)should_update);
+
+    if (should_update) {
+      // Data changed - signal main thread to update UI
+      // Read widget pointer while holding mutex
+      GtkWidget *widget = item_data->widget;
+
+      UpdateData *update_data = g_malloc(sizeof(UpdateData));
+      update_data->widget = widget;
+      update_data->id = item_data->id;
+      update_data->new_output = output ? g_strdup(output) : g_strdup("");
+      update_data->stats = item_data->stats;
+      update_data->ready_time = ready_time;
+
+      // Update stored previous output
+      g_free(item_data->previous_output);
+      item_data->previous_output = output ? g_strdup(output) : g_strdup("");
+
+      g_mutex_unlock(&item_data->mutex);
+
+      // Queue update to main thread
+      g_idle_add(update_ui_from_main_thread, update_data);
+    } else {
+      g_mutex_unlock(&item_data->mutex);
+    }
+
+    if (output != NULL) {
+      g_free(output);
+    }
+  }
+
+  // Mark thread as no longer running
+  g_mutex_lock(&item_data->mutex);
+  item_data->thread_running = FALSE;
+  g_cond_signal(&item_data->cond); // Signal in case cleanup is waiting
+  g_mutex_unlock(&item_data->mutex);
+
+  return NULL;
+}
+
+// Run the weather command once and extract both labels from its output
+static void fetch_weather(gchar **emoji, gchar **temp) {
+  CommandUsage usage;
+  gchar *output = run_cached_command(WEATHER_COMMAND, COMMAND_CACHE_TTL, NULL,
+                                    0, BAR_PRIORITY_NORMAL, &usage);
+  account_command_usage(&weather_module_stats, &usage);
+
+  *emoji = extract_value(&weather_emoji_extract, output);
+  *temp = extract_value(&weather_temp_extract, output);
+  USDT(weather_refresh, *emoji, *temp);
+  g_free(output);
+}
+
+// Weather worker thread function: polls at interval and signals main thread on
+// change
+static gpointer weather_worker_thread(gpointer user_data) {
+  WeatherData *wdata = (WeatherData *)user_data;
+
+  // Mark thread as running
+  g_mutex_lock(&wdata->mutex);
+  wdata->thread_running = TRUE;
+  g_mutex_unlock(&wdata->mutex);
+
+  // Initial update
+  gchar *emoji, *temp;
+  fetch_weather(&emoji, &temp);
+  gint64 ready_time = g_get_monotonic_time();
+
+  if (emoji != NULL || temp != NULL) {
+    g_mutex_lock(&wdata->mutex);
+    if (emoji != NULL)
+      wdata->previous_emoji = g_strdup(emoji);
+    if (temp != NULL)
+      wdata->previous_temp = g_strdup(temp);
+
+    GtkWidget *emoji_widget = wdata->emoji_widget;
+    GtkWidget *temp_widget = wdata->temp_widget;
+    g_mutex_unlock(&wdata->mutex);
+
+    WeatherUpdateData *update_data = g_malloc(sizeof(WeatherUpdateData));
+    update_data->emoji_widget = emoji_widget;
+    update_data->temp_widget = temp_widget;
+    update_data->new_emoji = emoji ? g_strdup(emoji) : NULL;
+    update_data->new_temp = temp ? g_strdup(temp) : NULL;
+    update_data->ready_time = ready_time;
+    g_idle_add(update_weather_ui_from_main_thread, update_data);
+
+    g_free(emoji);
+    g_free(temp);
+  }
+
+  // Poll at weather update interval
+  while (TRUE) {
+    g_mutex_lock(&wdata->mutex);
+
+    // Wait for interval or stop signal
+    gint64 wait_start = g_get_monotonic_time();
+
+    while (!wdata->should_stop) {
+      gint64 end_time =
+          get_scaled_deadline(wait_start, WEATHER_UPDATE_INTERVAL);
+      if (!g_cond_wait_until(&wdata->cond, &wdata->mutex, end_time)) {
+        break;
+      }
+      if (wdata->should_stop)
+        break;
+    }
+
+    if (wdata->should_stop) {
+      g_mutex_unlock(&wdata->mutex);
+      break;
+    }
+    g_mutex_unlock(&wdata->mutex);
+    TRACE_INSTANT("worker_wakeup", "weather");
+
+    // Fetch new weather data
+    fetch_weather(&emoji, &temp);
+    ready_time = g_get_monotonic_time();
+
+    if (emoji != NULL || temp != NULL) {
+      g_mutex_lock(&wdata->mutex);
+
+      gboolean emoji_changed = FALSE;
+      gboolean temp_changed = FALSE;
+
+      if (emoji != NULL && (wdata->previous_emoji == NULL ||
+                            strcmp(wdata->previous_emoji, emoji) != 0)) {
+        emoji_changed = TRUE;
+        g_free(wdata->previous_emoji);
+        wdata->previous_emoji = g_strdup(emoji);
+      }
+
+      if (temp != NULL && (wdata->previous_temp == NULL ||
+                           strcmp(wdata->previous_temp, temp) != 0)) {
+        temp_changed = TRUE;
+        g_free(wdata->previous_temp);
+        wdata->previous_temp = g_strdup(temp);
+      }
+
+      if (emoji_changed || temp_changed) {
+        GtkWidget *emoji_widget = wdata->emoji_widget;
+        GtkWidget *temp_widget = wdata->temp_widget;
+
+        WeatherUpdateData *update_data = g_malloc(sizeof(WeatherUpdateData));
+        update_data->emoji_widget = emoji_widget;
+        update_data->temp_widget = temp_widget;
+        update_data->new_emoji =
+            emoji_changed && emoji ? g_strdup(emoji) : NULL;
+        update_data->new_temp = temp_changed && temp ? g_strdup(temp) : NULL;
+        update_data->ready_time = ready_time;
+
+        g_mutex_unlock(&wdata->mutex);
+
+        g_idle_add(update_weather_ui_from_main_thread, update_data);
+      } else {
+        g_mutex_unlock(&wdata->mutex);
+      }
+
+      g_free(emoji);
+      g_free(temp);
+    }
+  }
+
+  // Mark thread as no longer running
+  g_mutex_lock(&wdata->mutex);
+  wdata->thread_running = FALSE;
+  g_cond_signal(&wdata->cond);
+  g_mutex_unlock(&wdata->mutex);
+
+  return NULL;
+}
+
+static gint64 stat_mtime_ns(const struct stat *st) {
+  return (gint64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Agenda index for one calendar file, cached on disk. The file holds the
+// header, the events sorted by start, the running maximum of their ends
+// (so overlap queries can binary search) and the NUL-separated summaries.
+typedef struct {
+  char magic[8];       // AGENDA_INDEX_MAGIC
+  gint64 source_mtime; // Modification time of the .ics, in nanoseconds
+  gint64 source_size;  // Size of the .ics
+  gint64 window_start; // Recurrences are expanded over this range (Unix
+  gint64 window_end;   // seconds)
+  guint32 count;
+  guint32 strings_size;
+} AgendaIndexHeader;
+
+#define AGENDA_INDEX_MAGIC "DTAGND1"
+
+typedef struct {
+  gint64 start; // Unix seconds
+  gint64 end;
+  guint32 summary; // Offset of the summary in the strings
+  guint32 all_day;
+} AgendaEvent;
+
+typedef struct {
+  gchar *path;         // Calendar file
+  GMappedFile *mapped; // Index, NULL until built
+  const AgendaIndexHeader *header;
+  const AgendaEvent *events;
+  const gint64 *max_end;
+  const char *strings;
+} AgendaIndex;
+
+// Only the date worker touches the agenda
+static GPtrArray *agenda_indexes = NULL;
+
+// Recurrences are expanded well past AGENDA_DAYS, so an index stays valid
+// for a while after it is built
+#define AGENDA_INDEX_DAYS MAX(60, 2 * AGENDA_DAYS)
+#define AGENDA_MAX_RECURRENCES 10000 // Occurrences tried per event
+#define AGENDA_DAY (24 * 60 * 60)    // Seconds
+
+// Calendar event while its VEVENT is being read
+typedef struct {
+  GDateTime *start;
+  GDateTime *end;  // NULL without DTEND
+  gint64 duration; // Seconds from DURATION, -1 without it
+  gboolean all_day;
+  gchar *summary;
+  gchar *rrule;
+  GArray *exdates; // Unix seconds of skipped occurrences
+  gboolean cancelled;
+  gchar *uid;
+  gboolean has_recurrence_id; // Overrides one occurrence of a recurring
+  gint64 recurrence_id;       // event with the same UID
+} IcsEvent;
+
+// Parser state for one calendar file
+typedef struct {
+  IcsEvent *event; // Inside a VEVENT
+  int nested;      // Depth of components inside it (e.g. VALARM)
+  gint64 window_start;
+  gint64 window_end;
+  GArray *events;   // AgendaEvent
+  GString *strings; // Summaries
+  // Recurring events are expanded after the whole file is read, since the
+  // occurrences overridden by other VEVENTs may come later in the file
+  GPtrArray *recurring;   // IcsEvent
+  GHashTable *overridden; // UID -> GArray of occurrence starts
+} IcsParser;
+
+static void free_ics_event(IcsEvent *event) {
+  if (event->start != NULL)
+    g_date_time_unref(event->start);
+  if (event->end != NULL)
+    g_date_time_unref(event->end);
+  g_free(event->summary);
+  g_free(event->rrule);
+  g_array_unref(event->exdates);
+  g_free(event->uid);
+  g_free(event);
+}
+
+// Value of a property parameter such as TZID in "DTSTART;TZID=X:..."
+static gchar *get_ics_param(const char *params, const char *name) {
+  gchar **parts = g_strsplit(params, ";", -1);
+  gchar *value = NULL;
+  gsize name_len = strlen(name);
+  for (gchar **part = parts; *part != NULL && value == NULL; part++) {
+    if (g_ascii_strncasecmp(*part, name, name_len) == 0 &&
+        (*part)[name_len] == '=')
+      value = g_strdup(*part + name_len + 1);
+  }
+  g_strfreev(parts);
+
+  // Quoted parameter values keep their quotes in the split
+  if (value != NULL && value[0] == '"') {
+    gchar *unquoted = g_strndup(value + 1, strcspn(value + 1, "\""));
+    g_free(value);
+    value = unquoted;
+  }
+  return value;
+}
+
+// DATE ("20240131") or DATE-TIME ("20240131T090000", "...Z") in the time
+// zone from TZID, or local time
+static GDateTime *parse_ics_time(const char *value, const char *params,
+                                 gboolean *all_day) {
+  int year, month, day, hour = 0, minute = 0, second = 0;
+  gsize len = strlen(value);
+  if (len < 8 || sscanf(value, "%4d%2d%2d", &year, &month, &day) != 3)
+    return NULL;
+
+  *all_day = value[8] != 'T';
+  if (!*all_day &&
+      (len < 15 ||
+       sscanf(value + 9, "%2d%2d%2d", &hour, &minute, &second) != 3))
+    return NULL;
+
+  GTimeZone *zone = NULL;
+  if (!*all_day && value[15] == 'Z') {
+    zone = g_time_zone_new_utc();
+  } else {
+    gchar *tzid = get_ics_param(params, "TZID");
+    if (tzid != NULL)
+      zone = g_time_zone_new_identifier(tzid);
+    g_free(tzid);
+  }
+  if (zone == NULL)
+    zone = g_time_zone_new_local();
+
+  GDateTime *time = g_date_time_new(zone, year, month, day, hour, minute,
+                                    second);
+  g_time_zone_unref(zone);
+  return time;
+}
+
+// DURATION such as "PT1H30M" or "P2D", in seconds
+static gint64 parse_ics_duration(const char *value) {
+  gint64 sign = 1, total = 0, number = 0;
+  if (*value == '-' || *value == '+')
+    sign = *value++ == '-' ? -1 : 1;
+  if (*value++ != 'P')
+    return -1;
+
+  for (; *value != '\0'; value++) {
+    if (g_ascii_isdigit(*value)) {
+      number = number * 10 + (*value - '0');
+      continue;
+    }
+    switch (*value) {
+    case 'W':
+      total += number * 7 * AGENDA_DAY;
+      break;
+    case 'D':
+      total += number * AGENDA_DAY;
+      break;
+    case 'H':
+      total += number * 3600;
+      break;
+    case 'M':
+      total += number * 60;
+      break;
+    case 'S':
+      total += number;
+      break;
+    }
+    number = 0;
+  }
+  return sign * total;
+}
+
+// TEXT values escape commas, semicolons, backslashes and newlines
+static gchar *unescape_ics_text(const char *value) {
+  GString *text = g_string_sized_new(strlen(value));
+  for (const char *p = value; *p != '\0'; p++) {
+    if (*p == '\\' && p[1] != '\0') {
+      p++;
+      g_string_append_c(text, (*p == 'n' || *p == 'N') ? ' ' : *p);
+    } else {
+      g_string_append_c(text, *p);
+    }
+  }
+  return g_string_free(text, FALSE);
+}
+
+static void add_agenda_event(IcsParser *parser, gint64 start, gint64 end,
+                             guint32 summary, gboolean all_day) {
+  if (start >= parser->window_end || end < parser->window_start)
+    return;
+
+  AgendaEvent event = {start, end, summary, all_day};
+  g_array_append_val(parser->events, event);
+}
+
+static gboolean is_ics_exdate(const IcsEvent *event, gint64 start) {
+  for (guint i = 0; i < event->exdates->len; i++) {
+    if (g_array_index(event->exdates, gint64, i) == start)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// Occurrence n periods after the event start, in its own time zone
+static GDateTime *add_ics_periods(GDateTime *start, const char *freq,
+                                  int periods) {
+  if (strcmp(freq, "DAILY") == 0)
+    return g_date_time_add_days(start, periods);
+  if (strcmp(freq, "WEEKLY") == 0)
+    return g_date_time_add_weeks(start, periods);
+  if (strcmp(freq, "MONTHLY") == 0)
+    return g_date_time_add_months(start, periods);
+  if (strcmp(freq, "YEARLY") == 0)
+    return g_date_time_add_years(start, periods);
+  return NULL;
+}
+
+// Expand an RRULE over the index window. FREQ, INTERVAL, COUNT, UNTIL and
+// BYDAY for weekly rules are supported; other BY* parts are ignored.
+static void expand_ics_rrule(IcsParser *parser, const IcsEvent *event,
+                             gint64 duration, guint32 summary) {
+  gchar freq[16] = "";
+  int interval = 1, count = 0, weekdays = 0;
+  gint64 until = G_MAXINT64;
+
+  gchar **parts = g_strsplit(event->rrule, ";", -1);
+  for (gchar **part = parts; *part != NULL; part++) {
+    if (g_str_has_prefix(*part, "FREQ=")) {
+      g_strlcpy(freq, *part + 5, sizeof(freq));
+    } else if (g_str_has_prefix(*part, "INTERVAL=")) {
+      interval = MAX(atoi(*part + 9), 1);
+    } else if (g_str_has_prefix(*part, "COUNT=")) {
+      count = atoi(*part + 6);
+    } else if (g_str_has_prefix(*part, "UNTIL=")) {
+      gboolean all_day;
+      GDateTime *time = parse_ics_time(*part + 6, "", &all_day);
+      if (time != NULL) {
+        until = g_date_time_to_unix(time) + (all_day ? AGENDA_DAY - 1 : 0);
+        g_date_time_unref(time);
+      }
+    } else if (g_str_has_prefix(*part, "BYDAY=")) {
+      static const char *names[] = {"MO", "TU", "WE", "TH", "FR", "SA", "SU"};
+      gchar **days = g_strsplit(*part + 6, ",", -1);
+      for (gchar **day = days; *day != NULL; day++) {
+        gsize len = strlen(*day);
+        for (int i = 0; i < 7 && len >= 2; i++) {
+          if (strcmp(*day + len - 2, names[i]) == 0)
+            weekdays |= 1 << i;
+        }
+      }
+      g_strfreev(days);
+    }
+  }
+  g_strfreev(parts);
+
+  // Rules recurring more often than daily are shown once
+  GDateTime *check = add_ics_periods(event->start, freq, 0);
+  if (check == NULL) {
+    gint64 start = g_date_time_to_unix(event->start);
+    add_agenda_event(parser, start, start + duration, summary,
+                     event->all_day);
+    return;
+  }
+  g_date_time_unref(check);
+
+  gboolean weekly = strcmp(freq, "WEEKLY") == 0;
+  int day_of_month = g_date_time_get_day_of_month(event->start);
+  int start_weekday = g_date_time_get_day_of_week(event->start); // 1 = MO
+  if (!weekly || weekdays == 0)
+    weekdays = 1 << (start_weekday - 1);
+
+  // Weekly occurrences are counted from the Monday of the start's week
+  GDateTime *base = weekly ? g_date_time_add_days(event->start,
+                                                  1 - start_weekday)
+                           : g_date_time_ref(event->start);
+  gint64 first = g_date_time_to_unix(event->start);
+
+  // Without COUNT, skip whole periods that end before the window. Periods
+  // are assumed as long as they can be, so nothing in the window is missed.
+  int skip = 0;
+  gint64 longest = 366 * AGENDA_DAY;
+  if (strcmp(freq, "DAILY") == 0)
+    longest = AGENDA_DAY;
+  else if (weekly)
+    longest = 7 * AGENDA_DAY;
+  else if (strcmp(freq, "MONTHLY") == 0)
+    longest = 31 * AGENDA_DAY;
+  longest = (longest + 3600) * interval; // DST
+  if (count == 0 && parser->window_start - duration > first)
+    skip = MAX((parser->window_start - duration - first) / longest - 1, 0);
+
+  int emitted = 0;
+  for (int n = skip; n < skip + AGENDA_MAX_RECURRENCES; n++) {
+    GDateTime *period = add_ics_periods(base, freq, n * interval);
+    if (period == NULL)
+      break;
+
+    gboolean done = FALSE;
+    for (int weekday = 0; weekday < 7 && !done; weekday++) {
+      if (!(weekdays & (1 << weekday)))
+        continue;
+
+      GDateTime *occurrence = weekly ? g_date_time_add_days(period, weekday)
+                                     : g_date_time_ref(period);
+      gint64 start = g_date_time_to_unix(occurrence);
+
+      // Months without the start's day (e.g. the 31st) have no occurrence
+      gboolean exists =
+          start >= first &&
+          (weekly || strcmp(freq, "DAILY") == 0 ||
+           g_date_time_get_day_of_month(occurrence) == day_of_month);
+      g_date_time_unref(occurrence);
+      if (!exists)
+        continue;
+
+      if ((count > 0 && emitted >= count) || start > until ||
+          start >= parser->window_end) {
+        done = TRUE;
+        break;
+      }
+      emitted++;
+      if (!is_ics_exdate(event, start))
+        add_agenda_event(parser, start, start + duration, summary,
+                         event->all_day);
+    }
+
+    g_date_time_unref(period);
+    if (done)
+      break;
+  }
+
+  g_date_time_unref(base);
+}
+
+// Add a finished VEVENT and its recurrences to the index
+static void finish_ics_event(IcsParser *parser, IcsEvent *event) {
+  if (event->start == NULL || event->cancelled)
+    return;
+
+  gint64 start = g_date_time_to_unix(event->start);
+  gint64 duration = event->all_day ? AGENDA_DAY : 0;
+  if (event->end != NULL)
+    duration = g_date_time_difference(event->end, event->start) /
+               G_USEC_PER_SEC;
+  else if (event->duration >= 0)
+    duration = event->duration;
+
+  guint32 summary = parser->strings->len;
+  g_string_append(parser->strings, event->summary ? event->summary : "");
+  g_string_append_c(parser->strings, '\0');
+
+  if (event->rrule != NULL)
+    expand_ics_rrule(parser, event, duration, summary);
+  else
+    add_agenda_event(parser, start, start + duration, summary,
+                     event->all_day);
+}
+
+// Handle one unfolded content line: "NAME;PARAMS:VALUE"
+static void handle_ics_line(IcsParser *parser, char *line) {
+  char *colon = strchr(line, ':');
+  if (colon == NULL)
+    return;
+  *colon = '\0';
+  const char *value = colon + 1;
+  char *params = strchr(line, ';');
+  if (params != NULL)
+    *params++ = '\0';
+  else
+    params = "";
+  const char *name = line;
+
+  if (strcmp(name, "BEGIN") == 0) {
+    if (parser->event != NULL) {
+      parser->nested++;
+    } else if (strcmp(value, "VEVENT") == 0) {
+      parser->event = g_new0(IcsEvent, 1);
+      parser->event->duration = -1;
+      parser->event->exdates = g_array_new(FALSE, FALSE, sizeof(gint64));
+    }
+    return;
+  }
+
+  IcsEvent *event = parser->event;
+  if (event == NULL)
+    return;
+
+  if (strcmp(name, "END") == 0) {
+    if (parser->nested > 0) {
+      parser->nested--;
+      return;
+    }
+
+    // An override replaces the occurrence it names, even when cancelled
+    if (event->has_recurrence_id && event->uid != NULL) {
+      GArray *starts = g_hash_table_lookup(parser->overridden, event->uid);
+      if (starts == NULL) {
+        starts = g_array_new(FALSE, FALSE, sizeof(gint64));
+        g_hash_table_insert(parser->overridden, g_strdup(event->uid),
+                            starts);
+      }
+      g_array_append_val(starts, event->recurrence_id);
+    }
+
+    if (event->rrule != NULL && !event->has_recurrence_id) {
+      g_ptr_array_add(parser->recurring, event);
+    } else {
+      finish_ics_event(parser, event);
+      free_ics_event(event);
+    }
+    parser->event = NULL;
+    return;
+  }
+
+  // Properties of alarms and other nested components are not the event's
+  if (parser->nested > 0)
+    return;
+
+  gboolean all_day = FALSE;
+  if (strcmp(name, "DTSTART") == 0) {
+    if (event->start != NULL)
+      g_date_time_unref(event->start);
+    event->start = parse_ics_time(value, params, &event->all_day);
+  } else if (strcmp(name, "DTEND") == 0) {
+    if (event->end != NULL)
+      g_date_time_unref(event->end);
+    event->end = parse_ics_time(value, params, &all_day);
+  } else if (strcmp(name, "DURATION") == 0) {
+    event->duration = parse_ics_duration(value);
+  } else if (strcmp(name, "SUMMARY") == 0) {
+    g_free(event->summary);
+    event->summary = unescape_ics_text(value);
+  } else if (strcmp(name, "RRULE") == 0) {
+    g_free(event->rrule);
+    event->rrule = g_strdup(value);
+  } else if (strcmp(name, "EXDATE") == 0) {
+    gchar **dates = g_strsplit(value, ",", -1);
+    for (gchar **date = dates; *date != NULL; date++) {
+      GDateTime *time = parse_ics_time(*date, params, &all_day);
+      if (time != NULL) {
+        gint64 start = g_date_time_to_unix(time);
+        g_array_append_val(event->exdates, start);
+        g_date_time_unref(time);
+      }
+    }
+    g_strfreev(dates);
+  } else if (strcmp(name, "STATUS") == 0) {
+    event->cancelled = strcmp(value, "CANCELLED") == 0;
+  } else if (strcmp(name, "UID") == 0) {
+    g_free(event->uid);
+    event->uid = g_strdup(value);
+  } else if (strcmp(name, "RECURRENCE-ID") == 0) {
+    GDateTime *time = parse_ics_time(value, params, &all_day);
+    if (time != NULL) {
+      event->has_recurrence_id = TRUE;
+      event->recurrence_id = g_date_time_to_unix(time);
+      g_date_time_unref(time);
+    }
+  }
+}
+
+// Expand the recurring events, skipping occurrences that were overridden
+static void finish_recurring_ics_events(IcsParser *parser) {
+  for (guint i = 0; i < parser->recurring->len; i++) {
+    IcsEvent *event = g_ptr_array_index(parser->recurring, i);
+    GArray *starts = event->uid != NULL
+                         ? g_hash_table_lookup(parser->overridden, event->uid)
+                         : NULL;
+    if (starts != NULL)
+      g_array_append_vals(event->exdates, starts->data, starts->len);
+    finish_ics_event(parser, event);
+  }
+}
+
+static gint compare_agenda_events(gconstpointer a, gconstpointer b) {
+  const AgendaEvent *event_a = a, *event_b = b;
+  if (event_a->start != event_b->start)
+    return event_a->start < event_b->start ? -1 : 1;
+  return (event_a->end > event_b->end) - (event_a->end < event_b->end);
+}
+
+static gchar *get_agenda_index_path(const char *path) {
+  gchar *absolute = realpath(path, NULL);
+  gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1,
+                                              absolute ? absolute : path, -1);
+  gchar *name = g_strdup_printf("agenda-%s.idx", hash);
+  gchar *index_path = g_build_filename(g_get_user_cache_dir(),
+                                       "desktop-thingy", name, NULL);
+  free(absolute);
+  g_free(hash);
+  g_free(name);
+  return index_path;
+}
+
+// Parse a calendar straight from its mapping, one unfolded line at a time,
+// and write the sorted index next to the wallpaper cache
+static gboolean build_agenda_index(const char *path, const struct stat *st,
+                                   gint64 now) {
+  GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+  if (mapped == NULL)
+    return FALSE;
+
+  TRACE_BEGIN("build_agenda_index", "agenda");
+  IcsParser parser = {
+      .window_start = now - AGENDA_DAY,
+      .window_end = now + (gint64)AGENDA_INDEX_DAYS * AGENDA_DAY,
+      .events = g_array_new(FALSE, FALSE, sizeof(AgendaEvent)),
+      .strings = g_string_new(NULL),
+      .recurring = g_ptr_array_new_with_free_func(
+          (GDestroyNotify)free_ics_event),
+      .overridden = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)g_array_unref),
+  };
+
+  // Lines starting with a space or tab continue the previous one
+  const char *p = g_mapped_file_get_contents(mapped);
+  const char *end = p + g_mapped_file_get_length(mapped);
+  GString *line = g_string_new(NULL);
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    gsize len = eol - p;
+    if (len > 0 && p[len - 1] == '\r')
+      len--;
+
+    if (len > 0 && (*p == ' ' || *p == '\t')) {
+      g_string_append_len(line, p + 1, len - 1);
+    } else {
+      if (line->len > 0)
+        handle_ics_line(&parser, line->str);
+      g_string_truncate(line, 0);
+      g_string_append_len(line, p, len);
+    }
+    p = eol + 1;
+  }
+  if (line->len > 0)
+    handle_ics_line(&parser, line->str);
+  g_string_free(line, TRUE);
+  if (parser.event != NULL)
+    free_ics_event(parser.event);
+  g_mapped_file_unref(mapped);
+  finish_recurring_ics_events(&parser);
+  g_ptr_array_unref(parser.recurring);
+  g_hash_table_unref(parser.overridden);
+
+  g_array_sort(parser.events, compare_agenda_events);
+  guint count = parser.events->len;
+  gint64 *max_end = g_new(gint64, MAX(count, 1));
+  for (guint i = 0; i < count; i++) {
+    gint64 event_end = g_array_index(parser.events, AgendaEvent, i).end;
+    max_end[i] = i > 0 ? MAX(max_end[i - 1], event_end) : event_end;
+  }
+
+  AgendaIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, AGENDA_INDEX_MAGIC, 8);
+  header.source_mtime = stat_mtime_ns(st);
+  header.source_size = st->st_size;
+  header.window_start = parser.window_start;
+  header.window_end = parser.window_end;
+  header.count = count;
+  header.strings_size = parser.strings->len;
+
+  gchar *index_path = get_agenda_index_path(path);
+  gchar *cache_dir = g_path_get_dirname(index_path);
+  gchar *tmp_path = g_strdup_printf("%s.XXXXXX", index_path);
+  FILE *fp = NULL;
+  if (g_mkdir_with_parents(cache_dir, 0700) == 0) {
+    int fd = g_mkstemp(tmp_path);
+    if (fd >= 0 && (fp = fdopen(fd, "wb")) == NULL) {
+      close(fd);
+      unlink(tmp_path);
+    }
+  }
+
+  gboolean ok = fp != NULL;
+  if (fp != NULL) {
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(parser.events->data, sizeof(AgendaEvent), count, fp) ==
+             count &&
+         fwrite(max_end, sizeof(gint64), count, fp) == count &&
+         fwrite(parser.strings->str, 1, parser.strings->len, fp) ==
+             parser.strings->len;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path, index_path) != 0) {
+      g_printerr("Failed to write agenda index: %s\n", index_path);
+      unlink(tmp_path);
+      ok = FALSE;
+    }
+  }
+
+  g_free(tmp_path);
+  g_free(cache_dir);
+  g_free(index_path);
+  g_free(max_end);
+  g_array_unref(parser.events);
+  g_string_free(parser.strings, TRUE);
+  TRACE_END("build_agenda_index");
+  return ok;
+}
+
+// Map an index if it matches the calendar and still covers the agenda
+static gboolean map_agenda_index(AgendaIndex *index, const struct stat *st,
+                                 gint64 now) {
+  gchar *index_path = get_agenda_index_path(index->path);
+  GMappedFile *mapped = g_mapped_file_new(index_path, FALSE, NULL);
+  g_free(index_path);
+  if (mapped == NULL)
+    return FALSE;
+
+  gsize length = g_mapped_file_get_length(mapped);
+  const char *contents = g_mapped_file_get_contents(mapped);
+  const AgendaIndexHeader *header = (const AgendaIndexHeader *)contents;
+  gboolean valid =
+      length >= sizeof(AgendaIndexHeader) &&
+      memcmp(header->magic, AGENDA_INDEX_MAGIC, 8) == 0 &&
+      header->source_mtime == stat_mtime_ns(st) &&
+      header->source_size == (gint64)st->st_size &&
+      header->window_start <= now &&
+      header->window_end >= now + AGENDA_DAYS * AGENDA_DAY &&
+      length == sizeof(AgendaIndexHeader) +
+                    (gsize)header->count *
+                        (sizeof(AgendaEvent) + sizeof(gint64)) +
+                    header->strings_size &&
+      (header->strings_size == 0 ||
+       contents[length - 1] == '\0');
+  if (!valid) {
+    g_mapped_file_unref(mapped);
+    return FALSE;
+  }
+
+  if (index->mapped != NULL)
+    g_mapped_file_unref(index->mapped);
+  index->mapped = mapped;
+  index->header = header;
+  index->events = (const AgendaEvent *)(contents + sizeof(*header));
+  index->max_end = (const gint64 *)(index->events + header->count);
+  index->strings = (const char *)(index->max_end + header->count);
+  return TRUE;
+}
+
+// Make sure an index matches its calendar, rebuilding it only when the file
+// changed or its recurrences no longer reach far enough
+static void update_agenda_index(AgendaIndex *index, gint64 now) {
+  struct stat st;
+  if (stat(index->path, &st) != 0) {
+    if (index->mapped != NULL) {
+      g_mapped_file_unref(index->mapped);
+      index->mapped = NULL;
+    }
+    return;
+  }
+
+  const AgendaIndexHeader *header = index->header;
+  if (index->mapped != NULL && header->source_mtime == stat_mtime_ns(&st) &&
+      header->source_size == (gint64)st.st_size &&
+      header->window_start <= now &&
+      header->window_end >= now + AGENDA_DAYS * AGENDA_DAY)
+    return;
+
+  if (!map_agenda_index(index, &st, now) &&
+      build_agenda_index(index->path, &st, now))
+    map_agenda_index(index, &st, now);
+}
+
+static void free_agenda_index(gpointer data) {
+  AgendaIndex *index = data;
+  if (index->mapped != NULL)
+    g_mapped_file_unref(index->mapped);
+  g_free(index->path);
+  g_free(index);
+}
+
+// Events overlapping [now, horizon), earliest first, at most max of them.
+// The running maximum of ends finds the first event that may still be
+// going on without scanning the past.
+static void lookup_agenda_index(const AgendaIndex *index, gint64 now,
+                                gint64 horizon, GArray *hits, guint max) {
+  guint low = 0, high = index->header->count;
+  while (low < high) {
+    guint mid = low + (high - low) / 2;
+    if (index->max_end[mid] > now)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+
+  guint found = 0;
+  for (guint i = low; i < index->header->count && found < max; i++) {
+    const AgendaEvent *event = &index->events[i];
+    if (event->start >= horizon)
+      break;
+    if (event->end > now || event->start >= now) {
+      g_array_append_val(hits, *event);
+      found++;
+    }
+  }
+}
+
+// AGENDA_FILES is a colon-separated list of .ics files
+static void start_agenda(void) {
+  const char *files = AGENDA_FILES;
+  if (files == NULL || agenda_indexes != NULL)
+    return;
+
+  agenda_indexes = g_ptr_array_new_with_free_func(free_agenda_index);
+  gchar **paths = g_strsplit(files, ":", -1);
+  for (gchar **path = paths; *path != NULL; path++) {
+    if (**path == '\0')
+      continue;
+    AgendaIndex *index = g_new0(AgendaIndex, 1);
+    index->path = g_str_has_prefix(*path, "~/")
+                      ? g_build_filename(g_get_home_dir(), *path + 2, NULL)
+                      : g_strdup(*path);
+    g_ptr_array_add(agenda_indexes, index);
+  }
+  g_strfreev(paths);
+}
+
+static void stop_agenda(void) {
+  if (agenda_indexes != NULL) {
+    g_ptr_array_unref(agenda_indexes);
+    agenda_indexes = NULL;
+  }
+}
+
+// The next events as one line each, e.g. "now Standup", "14:00 Review",
+// "Tue 09:00 Planning" or "Fri Holiday" for all-day events
+static gchar *get_agenda_text(gint64 now) {
+  if (agenda_indexes == NULL)
+    return NULL;
+
+  gint64 horizon = now + AGENDA_DAYS * AGENDA_DAY;
+  GArray *hits = g_array_new(FALSE, FALSE, sizeof(AgendaEvent));
+  GArray *summaries = g_array_new(FALSE, FALSE, sizeof(const char *));
+  for (guint i = 0; i < agenda_indexes->len; i++) {
+    AgendaIndex *index = g_ptr_array_index(agenda_indexes, i);
+    update_agenda_index(index, now);
+    if (index->mapped == NULL)
+      continue;
+
+    guint before = hits->len;
+    lookup_agenda_index(index, now, horizon, hits, AGENDA_MAX_EVENTS);
+    for (guint j = before; j < hits->len; j++) {
+      const char *summary =
+          index->strings + g_array_index(hits, AgendaEvent, j).summary;
+      g_array_append_val(summaries, summary);
+      // Point the hit at its summary's slot instead of the index's offset
+      g_array_index(hits, AgendaEvent, j).summary = summaries->len - 1;
+    }
+  }
+  g_array_sort(hits, compare_agenda_events);
+
+  GDateTime *today = g_date_time_new_from_unix_local(now);
+  gchar *today_date = g_date_time_format(today, "%F");
+  g_date_time_unref(today);
+
+  GString *text = g_string_new(NULL);
+  for (guint i = 0; i < MIN(hits->len, AGENDA_MAX_EVENTS); i++) {
+    const AgendaEvent *event = &g_array_index(hits, AgendaEvent, i);
+    GDateTime *start = g_date_time_new_from_unix_local(event->start);
+    gchar *start_date = g_date_time_format(start, "%F");
+    const char *format;
+    if (event->all_day)
+      format = event->start <= now ? "Today" : "%a";
+    else if (event->start <= now)
+      format = "now";
+    else
+      format = strcmp(start_date, today_date) == 0 ? "%H:%M" : "%a %H:%M";
+    g_free(start_date);
+    gchar *when = g_date_time_format(start, format);
+    g_date_time_unref(start);
+
+    if (text->len > 0)
+      g_string_append_c(text, '\n');
+    g_string_append_printf(
+        text, "%s %s", when,
+        g_array_index(summaries, const char *, event->summary));
+    g_free(when);
+  }
+
+  g_free(today_date);
+  g_array_unref(summaries);
+  g_array_unref(hits);
+  return g_string_free(text, FALSE);
+}
+
+// Post the agenda when it changed. Called after the date labels are posted,
+// so re-indexing a large calendar never holds them back.
+static void refresh_agenda(DateData *ddata) {
+  gchar *agenda = get_agenda_text(time(NULL));
+  if (agenda == NULL)
+    return;
+
+  g_mutex_lock(&ddata->mutex);
+  if (ddata->previous_agenda != NULL &&
+      strcmp(ddata->previous_agenda, agenda) == 0) {
+    g_mutex_unlock(&ddata->mutex);
+    g_free(agenda);
+    return;
+  }
+  g_free(ddata->previous_agenda);
+  ddata->previous_agenda = g_strdup(agenda);
+  GtkWidget *agenda_widget = ddata->agenda_widget;
+  g_mutex_unlock(&ddata->mutex);
+
+  DateUpdateData *update_data = g_malloc0(sizeof(DateUpdateData));
+  update_data->agenda_widget = agenda_widget;
+  update_data->new_agenda = agenda;
+  update_data->ready_time = g_get_monotonic_time();
+  g_idle_add(update_date_ui_from_main_thread, update_data);
+}
+
+// Date worker thread function: polls at interval and signals main thread on
+// change
+static gpointer date_worker_thread(gpointer user_data) {
+  DateData *ddata = (DateData *)user_data;
+
+  // Mark thread as running
+  g_mutex_lock(&ddata->mutex);
+  ddata->thread_running = TRUE;
+  g_mutex_unlock(&ddata->mutex);
+
+  start_agenda();
+
+  // Helper function to get current date strings
+  // Initial update
+  time_t rawtime;
+  struct tm *timeinfo;
+  char day_name[32];
+  char month_name[32];
+  char day_number[8];
+
+  time(&rawtime);
+  timeinfo = localtime(&rawtime);
+  strftime(day_name, sizeof(day_name), "%A", timeinfo);
+  strftime(month_name, sizeof(month_name), "%B", timeinfo);
+  strftime(day_number, sizeof(day_number), "%d", timeinfo);
+
+  // Convert to uppercase
+  for (int i = 0; day_name[i]; i++) {
+    day_name[i] = g_ascii_toupper(day_name[i]);
+  }
+  for (int i = 0; month_name[i]; i++) {
+    month_name[i] = g_ascii_toupper(month_name[i]);
+  }
+
+  gchar *day = g_strdup(day_name);
+  gchar *month = g_strdup(month_name);
+  gchar *day_num = g_strdup(day_number);
+  USDT(date_refresh, day, month, day_num);
+  gint64 ready_time = g_get_monotonic_time();
+
+  if (day != NULL || month != NULL || day_num != NULL) {
+    g_mutex_lock(&ddata->mutex);
+    if (day != NULL)
+      ddata->previous_day = g_strdup(day);
+    if (month != NULL)
+      ddata->previous_month = g_strdup(month);
+    if (day_num != NULL)
+      ddata->previous_day_number = g_strdup(day_num);
+
+    GtkWidget *day_widget = ddata->day_widget;
+    GtkWidget *month_widget = ddata->month_widget;
+    GtkWidget *day_number_widget = ddata->day_number_widget;
+    g_mutex_unlock(&ddata->mutex);
+
+    DateUpdateData *update_data = g_malloc(sizeof(DateUpdateData));
+    update_data->day_widget = day_widget;
+    update_data->month_widget = month_widget;
+    update_data->day_number_widget = day_number_widget;
+    update_data->agenda_widget = NULL;
+    update_data->new_day = day ? g_strdup(day) : NULL;
+    update_data->new_month = month ? g_strdup(month) : NULL;
+    update_data->new_day_number = day_num ? g_strdup(day_num) : NULL;
+    update_data->new_agenda = NULL;
+    update_data->ready_time = ready_time;
+    g_idle_add(update_date_ui_from_main_thread, update_data);
+
+    g_free(day);
+    g_free(month);
+    g_free(day_num);
+  }
+  refresh_agenda(ddata);
+
+  // Poll at date update interval
+  while (TRUE) {
+    g_mutex_lock(&ddata->mutex);
+
+    // Wait for interval or stop signal
+    gint64 wait_start = g_get_monotonic_time();
+
+    while (!ddata->should_stop) {
+      gint64 end_time = get_scaled_deadline(wait_start, DATE_UPDATE_INTERVAL);
+      if (!g_cond_wait_until(&ddata->cond, &ddata->mutex, end_time)) {
+        break;
+      }
+      if (ddata->should_stop)
+        break;
+    }
+
+    if (ddata->should_stop) {
+      g_mutex_unlock(&ddata->mutex);
+      break;
+    }
+    g_mutex_unlock(&ddata->mutex);
+    TRACE_INSTANT("worker_wakeup", "date");
+
+    // Get new date data
+    time(&rawtime);
+    timeinfo = localtime(&rawtime);
+    strftime(day_name, sizeof(day_name), "%A", timeinfo);
+    strftime(month_name, sizeof(month_name), "%B", timeinfo);
+    strftime(day_number, sizeof(day_number), "%d", timeinfo);
+
+    // Convert to uppercase
+    for (int i = 0; day_name[i]; i++) {
+      day_name[i] = g_ascii_toupper(day_name[i]);
+    }
     for (int i = 0; month_name[i]; i++) {
       month_name[i] = g_ascii_toupper(month_name[i]);
     }
 
-    day = g_strdup(day_name);
-    month = g_strdup(month_name);
-    day_num = g_strdup(day_number);
+    day = g_strdup(day_name);
+    month = g_strdup(month_name);
+    day_num = g_strdup(day_number);
+    USDT(date_refresh, day, month, day_num);
+    ready_time = g_get_monotonic_time();
+
+    if (day != NULL || month != NULL || day_num != NULL) {
+      g_mutex_lock(&ddata->mutex);
+
+      gboolean day_changed = FALSE;
+      gboolean month_changed = FALSE;
+      gboolean day_number_changed = FALSE;
+
+      if (day != NULL && (ddata->previous_day == NULL ||
+                          strcmp(ddata->previous_day, day) != 0)) {
+        day_changed = TRUE;
+        g_free(ddata->previous_day);
+        ddata->previous_day = g_strdup(day);
+      }
+
+      if (month != NULL && (ddata->previous_month == NULL ||
+                            strcmp(ddata->previous_month, month) != 0)) {
+        month_changed = TRUE;
+        g_free(ddata->previous_month);
+        ddata->previous_month = g_strdup(month);
+      }
+
+      if (day_num != NULL &&
+          (ddata->previous_day_number == NULL ||
+           strcmp(ddata->previous_day_number, day_num) != 0)) {
+        day_number_changed = TRUE;
+        g_free(ddata->previous_day_number);
+        ddata->previous_day_number = g_strdup(day_num);
+      }
+
+      if (day_changed || month_changed || day_number_changed) {
+        GtkWidget *day_widget = ddata->day_widget;
+        GtkWidget *month_widget = ddata->month_widget;
+        GtkWidget *day_number_widget = ddata->day_number_widget;
+
+        DateUpdateData *update_data = g_malloc(sizeof(DateUpdateData));
+        update_data->day_widget = day_widget;
+        update_data->month_widget = month_widget;
+        update_data->day_number_widget = day_number_widget;
+        update_data->agenda_widget = NULL;
+        update_data->new_day = day_changed && day ? g_strdup(day) : NULL;
+        update_data->new_month =
+            month_changed && month ? g_strdup(month) : NULL;
+        update_data->new_day_number =
+            day_number_changed && day_num ? g_strdup(day_num) : NULL;
+        update_data->new_agenda = NULL;
+        update_data->ready_time = ready_time;
+
+        g_mutex_unlock(&ddata->mutex);
+
+        g_idle_add(update_date_ui_from_main_thread, update_data);
+      } else {
+        g_mutex_unlock(&ddata->mutex);
+      }
+
+      g_free(day);
+      g_free(month);
+      g_free(day_num);
+    }
+    refresh_agenda(ddata);
+  }
+
+  stop_agenda();
+
+  // Mark thread as no longer running
+  g_mutex_lock(&ddata->mutex);
+  ddata->thread_running = FALSE;
+  g_cond_signal(&ddata->cond);
+  g_mutex_unlock(&ddata->mutex);
+
+  return NULL;
+}
+
+// Cache file for an image at a given output size. The image's mtime and
+// size are checked against the header, so a changed wallpaper simply
+// overwrites its old entry.
+static gchar *get_wallpaper_cache_path(const char *path, int width,
+                                       int height) {
+  gchar *absolute = realpath(path, NULL);
+  gchar *key = g_strdup_printf("%s|%dx%d", absolute ? absolute : path, width,
+                               height);
+  gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+  gchar *name = g_strdup_printf("wallpaper-%s.raw", hash);
+  gchar *cache_path = g_build_filename(g_get_user_cache_dir(), "desktop-thingy",
+                                       name, NULL);
+  free(absolute);
+  g_free(key);
+  g_free(hash);
+  g_free(name);
+  return cache_path;
+}
+
+static void free_wallpaper_source(gpointer data) {
+  WallpaperSource *source = data;
+  g_atomic_int_add(&decoded_wallpaper_kb, -(gint)(source->decoded / 1024));
+  g_free(source->path);
+  g_bytes_unref(source->pixels);
+  g_free(source);
+}
+
+static void attach_wallpaper_source(GdkTexture *texture, const char *path,
+                                    GBytes *pixels, int width, int height,
+                                    int stride, int bpp, gboolean mapped) {
+  WallpaperSource *source = g_new0(WallpaperSource, 1);
+  source->path = g_strdup(path);
+  source->pixels = g_bytes_ref(pixels);
+  source->width = width;
+  source->height = height;
+  source->stride = stride;
+  source->bpp = bpp;
+  if (!mapped) {
+    source->decoded = g_bytes_get_size(pixels);
+    g_atomic_int_add(&decoded_wallpaper_kb, (gint)(source->decoded / 1024));
+  }
+  g_object_set_data_full(G_OBJECT(texture), "wallpaper-source", source,
+                         free_wallpaper_source);
+}
+
+// Map a cached wallpaper straight into a texture. Returns NULL on a miss. A
+// hit refreshes the entry's access time, which eviction goes by.
+static GdkTexture *load_cached_wallpaper(const char *path, int width,
+                                         int height) {
+  struct stat st;
+  if (!WALLPAPER_CACHE || stat(path, &st) != 0)
+    return NULL;
+
+  gchar *cache_path = get_wallpaper_cache_path(path, width, height);
+  GMappedFile *mapped = g_mapped_file_new(cache_path, FALSE, NULL);
+  if (mapped == NULL) {
+    g_free(cache_path);
+    return NULL;
+  }
+
+  GdkTexture *texture = NULL;
+  gsize length = g_mapped_file_get_length(mapped);
+  const WallpaperCacheHeader *header =
+      (const WallpaperCacheHeader *)g_mapped_file_get_contents(mapped);
+
+  if (length >= sizeof(WallpaperCacheHeader) &&
+      memcmp(header->magic, WALLPAPER_CACHE_MAGIC, 8) == 0 &&
+      header->source_mtime == stat_mtime_ns(&st) &&
+      header->source_size == (gint64)st.st_size && header->width > 0 &&
+      header->height > 0 &&
+      (header->format == GDK_MEMORY_R8G8B8A8 ||
+       header->format == GDK_MEMORY_R8G8B8)) {
+    gsize bpp = header->format == GDK_MEMORY_R8G8B8A8 ? 4 : 3;
+    gsize pixels_length = (gsize)header->stride * (header->height - 1) +
+                          (gsize)header->width * bpp;
+
+    if (header->stride >= header->width * (gint32)bpp &&
+        length - sizeof(WallpaperCacheHeader) >= pixels_length) {
+      // The texture keeps the mapping alive through the bytes
+      GBytes *file_bytes = g_mapped_file_get_bytes(mapped);
+      GBytes *pixels = g_bytes_new_from_bytes(
+          file_bytes, sizeof(WallpaperCacheHeader), pixels_length);
+      texture = gdk_memory_texture_new(header->width, header->height,
+                                       header->format, pixels, header->stride);
+      attach_wallpaper_source(texture, path, pixels, header->width,
+                              header->height, header->stride, (int)bpp, TRUE);
+      g_bytes_unref(pixels);
+      g_bytes_unref(file_bytes);
+    }
+  }
+
+  g_mapped_file_unref(mapped);
+  if (texture != NULL) {
+    struct timespec times[2] = {{.tv_nsec = UTIME_NOW},
+                                {.tv_nsec = UTIME_OMIT}};
+    utimensat(AT_FDCWD, cache_path, times, 0);
+  }
+  g_free(cache_path);
+  return texture;
+}
+
+typedef struct {
+  gchar *path;
+  gint64 size;
+  gint64 atime; // Nanoseconds
+} WallpaperCacheEntry;
+
+static gint compare_wallpaper_cache_entries(gconstpointer a, gconstpointer b) {
+  const WallpaperCacheEntry *entry_a = a, *entry_b = b;
+  return (entry_a->atime > entry_b->atime) - (entry_a->atime < entry_b->atime);
+}
+
+// Image an entry was decoded from, or NULL for an unreadable entry
+static gchar *read_wallpaper_cache_source(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  WallpaperCacheHeader header;
+  gchar *source = NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 &&
+      pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(header.magic, WALLPAPER_CACHE_MAGIC, 8) == 0 &&
+      header.source_path_length > 0 &&
+      header.source_path_length < PATH_MAX &&
+      (gint64)header.source_path_length < st.st_size) {
+    source = g_malloc(header.source_path_length + 1);
+    off_t offset = st.st_size - header.source_path_length;
+    if (pread(fd, source, header.source_path_length, offset) !=
+        (ssize_t)header.source_path_length) {
+      g_free(source);
+      source = NULL;
+    } else {
+      source[header.source_path_length] = '\0';
+    }
+  }
+  close(fd);
+  return source;
+}
+
+// Drop entries whose image is gone or that belong to an older cache format,
+// then the least recently shown ones until the cache fits
+// WALLPAPER_CACHE_MAX_MB. The entry just written is always kept.
+static void prune_wallpaper_cache(const char *cache_dir, const char *keep) {
+  GDir *dir = g_dir_open(cache_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  TRACE_BEGIN("prune_wallpaper_cache", NULL);
+  GArray *entries = g_array_new(FALSE, FALSE, sizeof(WallpaperCacheEntry));
+  gint64 total = 0;
+  const gchar *name;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    if (!g_str_has_prefix(name, "wallpaper-") ||
+        !g_str_has_suffix(name, ".raw"))
+      continue;
+
+    gchar *path = g_build_filename(cache_dir, name, NULL);
+    gchar *source = read_wallpaper_cache_source(path);
+    struct stat st;
+    if (source == NULL || access(source, F_OK) != 0) {
+      if (strcmp(path, keep) != 0)
+        unlink(path);
+      g_free(path);
+    } else if (stat(path, &st) == 0) {
+      WallpaperCacheEntry entry = {
+          path, st.st_size,
+          (gint64)st.st_atim.tv_sec * 1000000000 + st.st_atim.tv_nsec};
+      g_array_append_val(entries, entry);
+      total += st.st_size;
+    } else {
+      g_free(path);
+    }
+    g_free(source);
+  }
+  g_dir_close(dir);
+
+  g_array_sort(entries, compare_wallpaper_cache_entries);
+  gint64 limit = (gint64)WALLPAPER_CACHE_MAX_MB * 1024 * 1024;
+  for (guint i = 0; i < entries->len; i++) {
+    WallpaperCacheEntry *entry =
+        &g_array_index(entries, WallpaperCacheEntry, i);
+    if (total > limit && strcmp(entry->path, keep) != 0 &&
+        unlink(entry->path) == 0)
+      total -= entry->size;
+    g_free(entry->path);
+  }
+  g_array_unref(entries);
+  TRACE_END("prune_wallpaper_cache");
+}
+
+// Write decoded pixels to the cache, replacing any previous entry atomically.
+// Each write goes through its own temporary file, so instances decoding the
+// same image don't clobber each other.
+static void save_cached_wallpaper(const char *path, int width, int height,
+                                  GdkPixbuf *pixbuf) {
+  struct stat st;
+  gchar *absolute = realpath(path, NULL);
+  if (absolute == NULL || stat(absolute, &st) != 0) {
+    free(absolute);
+    return;
+  }
+
+  gchar *cache_path = get_wallpaper_cache_path(path, width, height);
+  gchar *cache_dir = g_path_get_dirname(cache_path);
+  gchar *tmp_path = g_strdup_printf("%s.XXXXXX", cache_path);
+
+  WallpaperCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WALLPAPER_CACHE_MAGIC, 8);
+  header.source_mtime = stat_mtime_ns(&st);
+  header.source_size = st.st_size;
+  header.width = gdk_pixbuf_get_width(pixbuf);
+  header.height = gdk_pixbuf_get_height(pixbuf);
+  header.stride = gdk_pixbuf_get_rowstride(pixbuf);
+  header.format = gdk_pixbuf_get_has_alpha(pixbuf) ? GDK_MEMORY_R8G8B8A8
+                                                   : GDK_MEMORY_R8G8B8;
+  header.source_path_length = strlen(absolute);
+
+  GBytes *bytes = gdk_pixbuf_read_pixel_bytes(pixbuf);
+  gsize pixels_length;
+  const void *pixels = g_bytes_get_data(bytes, &pixels_length);
+
+  FILE *fp = NULL;
+  if (g_mkdir_with_parents(cache_dir, 0700) == 0) {
+    int fd = g_mkstemp(tmp_path);
+    if (fd >= 0 && (fp = fdopen(fd, "wb")) == NULL) {
+      close(fd);
+      unlink(tmp_path);
+    }
+  }
+
+  if (fp != NULL) {
+    gboolean ok =
+        fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(pixels, 1, pixels_length, fp) == pixels_length &&
+        fwrite(absolute, 1, header.source_path_length, fp) ==
+            header.source_path_length;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path, cache_path) != 0) {
+      g_printerr("Failed to write wallpaper cache: %s\n", cache_path);
+      unlink(tmp_path);
+    } else {
+      prune_wallpaper_cache(cache_dir, cache_path);
+    }
+  }
+
+  g_bytes_unref(bytes);
+  free(absolute);
+  g_free(tmp_path);
+  g_free(cache_dir);
+  g_free(cache_path);
+}
+
+// Decode an image scaled to width x height (-1 keeps the natural size) into
+// an immutable texture, going through the wallpaper cache. Safe to call from
+// worker threads.
+static GdkTexture *load_wallpaper_texture(const char *path, int width,
+                                          int height, GError **error) {
+  GdkTexture *texture = load_cached_wallpaper(path, width, height);
+  if (texture != NULL)
+    return texture;
+
+  GdkPixbuf *pixbuf =
+      gdk_pixbuf_new_from_file_at_scale(path, width, height, FALSE, error);
+  if (pixbuf == NULL)
+    return NULL;
+
+  if (WALLPAPER_CACHE) {
+    save_cached_wallpaper(path, width, height, pixbuf);
+
+    // Show the file-backed copy so the kernel can drop its pages under
+    // pressure instead of the decoded pixels staying on the heap
+    if (low_memory_mode) {
+      texture = load_cached_wallpaper(path, width, height);
+      if (texture != NULL) {
+        g_object_unref(pixbuf);
+        return texture;
+      }
+    }
+  }
+
+  GBytes *bytes = gdk_pixbuf_read_pixel_bytes(pixbuf);
+  texture = gdk_memory_texture_new(
+      gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf),
+      gdk_pixbuf_get_has_alpha(pixbuf) ? GDK_MEMORY_R8G8B8A8
+                                       : GDK_MEMORY_R8G8B8,
+      bytes, gdk_pixbuf_get_rowstride(pixbuf));
+  attach_wallpaper_source(texture, path, bytes, gdk_pixbuf_get_width(pixbuf),
+                          gdk_pixbuf_get_height(pixbuf),
+                          gdk_pixbuf_get_rowstride(pixbuf),
+                          gdk_pixbuf_get_has_alpha(pixbuf) ? 4 : 3, FALSE);
+  g_bytes_unref(bytes);
+  g_object_unref(pixbuf);
+
+  return texture;
+}
+
+// Output a window's surface is on, or the first output until it is mapped
+static GdkMonitor *get_window_output(GtkWidget *window) {
+  GdkDisplay *display = gdk_display_get_default();
+  GdkSurface *surface =
+      window != NULL ? gtk_native_get_surface(GTK_NATIVE(window)) : NULL;
+  GdkMonitor *monitor = NULL;
+  if (surface != NULL)
+    monitor = gdk_display_get_monitor_at_surface(display, surface);
+
+  if (monitor == NULL) {
+    GListModel *monitors = gdk_display_get_monitors(display);
+    if (g_list_model_get_n_items(monitors) > 0) {
+      monitor = g_list_model_get_item(monitors, 0);
+      g_object_unref(monitor); // The list keeps it alive
+    }
+  }
+  return monitor;
+}
+
+static void unwatch_output(OutputWatch *watch) {
+  if (watch->monitor == NULL)
+    return;
+
+  g_signal_handler_disconnect(watch->monitor, watch->geometry_handler);
+  g_clear_object(&watch->monitor);
+}
+
+// Call on_geometry when monitor's geometry changes, instead of whatever
+// output watch followed before
+static void watch_output(OutputWatch *watch, GdkMonitor *monitor,
+                         GCallback on_geometry) {
+  if (watch->monitor == monitor)
+    return;
+
+  unwatch_output(watch);
+  if (monitor == NULL)
+    return;
+
+  watch->monitor = g_object_ref(monitor);
+  watch->geometry_handler =
+      g_signal_connect(monitor, "notify::geometry", on_geometry, NULL);
+}
+
+static void refresh_wallpaper_size(void);
+
+static void on_background_output_geometry(GObject *object, GParamSpec *pspec,
+                                          gpointer user_data) {
+  (void)object;
+  (void)pspec;
+  (void)user_data;
+  refresh_wallpaper_size();
+}
+
+// Size of the output the wallpaper is shown on, in device pixels. The
+// output is watched, so a resize decodes the wallpapers again.
+static void get_output_size(int *width, int *height) {
+  *width = -1;
+  *height = -1;
+
+  GdkMonitor *monitor = get_window_output(background_window);
+  if (background_window != NULL)
+    watch_output(&background_output, monitor,
+                 G_CALLBACK(on_background_output_geometry));
+  if (monitor == NULL)
+    return;
+
+  GdkRectangle geometry;
+  gdk_monitor_get_geometry(monitor, &geometry);
+  int scale = gdk_monitor_get_scale_factor(monitor);
+  *width = geometry.width * scale;
+  *height = geometry.height * scale;
+}
+
+static gboolean is_wallpaper_file(const char *name) {
+  static const char *extensions[] = {".png",  ".jpg", ".jpeg", ".webp",
+                                     ".bmp",  ".gif", ".tif",  ".tiff"};
+  gchar *lower = g_ascii_strdown(name, -1);
+  gboolean match = FALSE;
+  for (size_t i = 0; i < G_N_ELEMENTS(extensions) && !match; i++)
+    match = g_str_has_suffix(lower, extensions[i]);
+  g_free(lower);
+  return match;
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b) {
+  return g_strcmp0(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+// Collect the slideshow paths from --background-dir or --background-playlist,
+// falling back to the single --background-image
+static gchar **collect_slideshow_paths(void) {
+  GPtrArray *paths = g_ptr_array_new();
+
+  if (background_dir_path != NULL) {
+    GError *error = NULL;
+    GDir *dir = g_dir_open(background_dir_path, 0, &error);
+    if (dir == NULL) {
+      g_printerr("Failed to open background directory: %s\n", error->message);
+      g_error_free(error);
+    } else {
+      const gchar *name;
+      while ((name = g_dir_read_name(dir)) != NULL) {
+        if (is_wallpaper_file(name)) {
+          g_ptr_array_add(paths,
+                          g_build_filename(background_dir_path, name, NULL));
+        }
+      }
+      g_dir_close(dir);
+      g_ptr_array_sort(paths, compare_paths);
+    }
+  } else if (background_playlist_path != NULL) {
+    gchar *contents = NULL;
+    GError *error = NULL;
+    if (!g_file_get_contents(background_playlist_path, &contents, NULL,
+                             &error)) {
+      g_printerr("Failed to read background playlist: %s\n", error->message);
+      g_error_free(error);
+    } else {
+      // One path per line, relative paths are relative to the playlist
+      gchar *base = g_path_get_dirname(background_playlist_path);
+      gchar **lines = g_strsplit(contents, "\n", -1);
+      for (gchar **line = lines; *line != NULL; line++) {
+        gchar *entry = g_strstrip(*line);
+        if (*entry == '\0' || *entry == '#')
+          continue;
+        g_ptr_array_add(paths, g_path_is_absolute(entry)
+                                   ? g_strdup(entry)
+                                   : g_build_filename(base, entry, NULL));
+      }
+      g_strfreev(lines);
+      g_free(base);
+      g_free(contents);
+    }
+  } else if (background_image_path != NULL) {
+    g_ptr_array_add(paths, g_strdup(background_image_path));
+  }
+
+  g_ptr_array_add(paths, NULL);
+  return (gchar **)g_ptr_array_free(paths, FALSE);
+}
+
+// Identity of an image file for the palette cache: path, size and mtime
+static gchar *get_wallpaper_key(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return NULL;
+
+  gchar *absolute = realpath(path, NULL);
+  gchar *key = g_strdup_printf("%s|%" G_GINT64_FORMAT "|%" G_GINT64_FORMAT,
+                               absolute ? absolute : path, stat_mtime_ns(&st),
+                               (gint64)st.st_size);
+  gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+  free(absolute);
+  g_free(key);
+  return hash;
+}
+
+static gchar *get_palette_cache_path(void) {
+  return g_build_filename(g_get_user_cache_dir(), "desktop-thingy",
+                          "palettes.ini", NULL);
+}
+
+// Histogram of colours quantized to 4 bits per channel
+#define PALETTE_BINS 4096
+
+typedef struct {
+  guint32 count[PALETTE_BINS];
+  guint64 sum[PALETTE_BINS][3];
+} PaletteHistogram;
+
+typedef guint32 PixelVector __attribute__((vector_size(16)));
+typedef guint8 PixelBytes __attribute__((vector_size(16)));
+
+// Shuffles gathering channel c of pixel p into byte 4 * c + p, for four
+// R8G8B8A8 or R8G8B8 pixels loaded as they are laid out in memory
+static const PixelBytes rgba_planes = {0, 4, 8,  12, 1, 5, 9,  13,
+                                       2, 6, 10, 14, 3, 7, 11, 15};
+static const PixelBytes rgb_planes = {0, 3, 6, 9,  1,  4,  7,  10,
+                                      2, 5, 8, 11, 15, 15, 15, 15};
+
+// Bin four pixels at once. Lanes are built from bytes, so the result does
+// not depend on the host's byte order.
+static void add_pixel_block(PaletteHistogram *histogram, PixelBytes bytes,
+                            PixelBytes planes) {
+  PixelBytes channels = __builtin_shuffle(bytes, planes);
+  PixelVector r = {channels[0], channels[1], channels[2], channels[3]};
+  PixelVector g = {channels[4], channels[5], channels[6], channels[7]};
+  PixelVector b = {channels[8], channels[9], channels[10], channels[11]};
+  PixelVector bins = ((r >> 4) << 8) | ((g >> 4) << 4) | (b >> 4);
+
+  for (int lane = 0; lane < 4; lane++) {
+    guint32 bin = bins[lane];
+    histogram->count[bin]++;
+    histogram->sum[bin][0] += r[lane];
+    histogram->sum[bin][1] += g[lane];
+    histogram->sum[bin][2] += b[lane];
+  }
+}
+
+static void add_pixel(PaletteHistogram *histogram, const guint8 *pixel) {
+  guint32 bin =
+      ((pixel[0] >> 4) << 8) | ((pixel[1] >> 4) << 4) | (pixel[2] >> 4);
+  histogram->count[bin]++;
+  for (int c = 0; c < 3; c++)
+    histogram->sum[bin][c] += pixel[c];
+}
+
+// Bin a row of R8G8B8A8 pixels, four at a time
+static void add_rgba_row(PaletteHistogram *histogram, const guint8 *row,
+                         int width) {
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    PixelBytes bytes;
+    memcpy(&bytes, row + x * 4, sizeof(bytes));
+    add_pixel_block(histogram, bytes, rgba_planes);
+  }
+
+  for (; x < width; x++)
+    add_pixel(histogram, row + x * 4);
+}
+
+// Bin a row of R8G8B8 pixels (JPEG wallpapers), four at a time: 12 bytes
+// are loaded and shuffled into the same lanes as the RGBA path
+static void add_rgb_row(PaletteHistogram *histogram, const guint8 *row,
+                        int width) {
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    PixelBytes bytes = {0};
+    memcpy(&bytes, row + x * 3, 12);
+    add_pixel_block(histogram, bytes, rgb_planes);
+  }
+
+  for (; x < width; x++)
+    add_pixel(histogram, row + x * 3);
+}
+
+// Most common colour for the background, and the most common saturated
+// colour that is clearly different from it for the border
+static void compute_bar_palette(const WallpaperSource *source,
+                                BarPalette *palette) {
+  PaletteHistogram *histogram = g_new0(PaletteHistogram, 1);
+  const guint8 *pixels = g_bytes_get_data(source->pixels, NULL);
+
+  // Sample whole rows so the inner loop stays contiguous
+  gint64 total = (gint64)source->width * source->height;
+  int row_step = (int)MAX(total / BAR_THEME_SAMPLES, 1);
+  for (int y = 0; y < source->height; y += row_step) {
+    const guint8 *row = pixels + (gsize)y * source->stride;
+    if (source->bpp == 4)
+      add_rgba_row(histogram, row, source->width);
+    else
+      add_rgb_row(histogram, row, source->width);
+  }
+
+  int dominant = 0;
+  for (int bin = 1; bin < PALETTE_BINS; bin++) {
+    if (histogram->count[bin] > histogram->count[dominant])
+      dominant = bin;
+  }
+
+  guint8 mean[3];
+  for (int c = 0; c < 3; c++) {
+    mean[c] = histogram->count[dominant] > 0
+                  ? histogram->sum[dominant][c] / histogram->count[dominant]
+                  : 0;
+    palette->dominant[c] = mean[c];
+  }
+
+  int accent = -1;
+  double best_score = 0;
+  for (int bin = 0; bin < PALETTE_BINS; bin++) {
+    guint32 count = histogram->count[bin];
+    if (count == 0)
+      continue;
+
+    int colour[3], distance = 0;
+    for (int c = 0; c < 3; c++) {
+      colour[c] = histogram->sum[bin][c] / count;
+      distance += (colour[c] - mean[c]) * (colour[c] - mean[c]);
+    }
+    if (distance < 96 * 96)
+      continue;
+
+    int high = MAX(colour[0], MAX(colour[1], colour[2]));
+    int low = MIN(colour[0], MIN(colour[1], colour[2]));
+    double saturation = high > 0 ? (double)(high - low) / high : 0;
+    double score = count * (0.2 + saturation);
+    if (score > best_score) {
+      best_score = score;
+      accent = bin;
+    }
+  }
+
+  // A flat wallpaper has no second colour; contrast with the background
+  for (int c = 0; c < 3; c++) {
+    if (accent >= 0)
+      palette->accent[c] =
+          histogram->sum[accent][c] / histogram->count[accent];
+    else
+      palette->accent[c] = mean[c] < 128 ? 255 - (255 - mean[c]) / 4
+                                         : mean[c] / 4;
+  }
+
+  g_free(histogram);
+}
+
+static gboolean load_cached_palette(GKeyFile *cache, const char *key,
+                                    BarPalette *palette) {
+  gsize length = 0;
+  gint *values = g_key_file_get_integer_list(cache, "palettes", key, &length,
+                                             NULL);
+  gboolean ok = values != NULL && length == 6;
+  for (gsize i = 0; ok && i < 3; i++) {
+    palette->dominant[i] = (guint8)values[i];
+    palette->accent[i] = (guint8)values[i + 3];
+  }
+  g_free(values);
+  return ok;
+}
+
+static void save_cached_palette(GKeyFile *cache, const char *key,
+                                const BarPalette *palette) {
+  gint values[6];
+  for (int i = 0; i < 3; i++) {
+    values[i] = palette->dominant[i];
+    values[i + 3] = palette->accent[i];
+  }
+  g_key_file_set_integer_list(cache, "palettes", key, values, 6);
+
+  gchar *cache_path = get_palette_cache_path();
+  gchar *cache_dir = g_path_get_dirname(cache_path);
+  if (g_mkdir_with_parents(cache_dir, 0700) == 0)
+    g_key_file_save_to_file(cache, cache_path, NULL);
+  g_free(cache_dir);
+  g_free(cache_path);
+}
+
+// Pixels as four 32-bit lanes (R, G, B, A) for the box blur's running sums
+typedef guint32 ChannelVector __attribute__((vector_size(16)));
+
+static ChannelVector load_channels(const guint8 *pixel) {
+  return (ChannelVector){pixel[0], pixel[1], pixel[2], pixel[3]};
+}
+
+// One box blur pass over count RGBA pixels spaced step bytes apart, edges
+// clamped. The running sum keeps the cost independent of the radius.
+static void box_blur_line(const guint8 *src, guint8 *dst, int count,
+                          gsize step, int radius) {
+  // Fixed-point reciprocal rounded up, so flat areas keep their value
+  // (exact for radii below 128)
+  guint32 scale = (65536 + 2 * radius) / (2 * radius + 1);
+  ChannelVector sum = load_channels(src) * (guint32)(radius + 1);
+  for (int i = 1; i <= radius; i++)
+    sum += load_channels(src + MIN(i, count - 1) * step);
+
+  for (int i = 0; i < count; i++) {
+    ChannelVector mean = (sum * scale) >> 16;
+    guint8 *out = dst + i * step;
+    for (int c = 0; c < 4; c++)
+      out[c] = (guint8)mean[c];
+
+    sum += load_channels(src + MIN(i + radius + 1, count - 1) * step);
+    sum -= load_channels(src + MAX(i - radius, 0) * step);
+  }
+}
+
+// Three box passes in each direction approximate a Gaussian blur
+static void blur_rgba(guint8 *pixels, int width, int height, int radius) {
+  gsize stride = (gsize)width * 4;
+  guint8 *line = g_malloc(MAX(stride, (gsize)height * 4));
+
+  for (int pass = 0; pass < 3; pass++) {
+    for (int y = 0; y < height; y++) {
+      box_blur_line(pixels + y * stride, line, width, 4, radius);
+      memcpy(pixels + y * stride, line, stride);
+    }
+    for (int x = 0; x < width; x++) {
+      box_blur_line(pixels + x * 4, line, height, stride, radius);
+      for (int y = 0; y < height; y++)
+        memcpy(pixels + y * stride + x * 4, line + y * 4, 4);
+    }
+  }
+
+  g_free(line);
+}
+
+// Blur the part of a wallpaper under the bar's exclusive zone and save it
+// as a PNG, reusing an earlier result for the same image and output size
+static gchar *compute_frosted_strip(const WallpaperSource *source,
+                                    const char *key, int output_width,
+                                    int output_height) {
+  gchar *name_key = g_strdup_printf("%s|%dx%d|%d|%d", key, output_width,
+                                    output_height, BAR_FROSTED_RADIUS,
+                                    BAR_PADDING_TOP + BAR_HEIGHT +
+                                        BAR_PADDING_BOTTOM);
+  gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, name_key, -1);
+  gchar *name = g_strdup_printf("frosted-%s.png", hash);
+  gchar *path = g_build_filename(g_get_user_cache_dir(), "desktop-thingy",
+                                 name, NULL);
+  g_free(name);
+  g_free(hash);
+  g_free(name_key);
+
+  if (g_file_test(path, G_FILE_TEST_EXISTS))
+    return path;
+
+  // The wallpaper is stretched over the output, so map logical pixels to
+  // image rows; blur a little below the strip so its bottom edge is not
+  // clamped
+  double scale_x = (double)source->width / output_width;
+  double scale_y = (double)source->height / output_height;
+  int radius = CLAMP((int)(BAR_FROSTED_RADIUS * scale_x), 1, 127);
+  int strip_height = (int)((BAR_PADDING_TOP + BAR_HEIGHT + BAR_PADDING_BOTTOM) *
+                           scale_y);
+  strip_height = CLAMP(strip_height, 1, source->height);
+  int height = MIN(strip_height + radius * 2, source->height);
+  int width = source->width;
+
+  guint8 *pixels = g_malloc((gsize)width * height * 4);
+  const guint8 *src = g_bytes_get_data(source->pixels, NULL);
+  for (int y = 0; y < height; y++) {
+    const guint8 *row = src + (gsize)y * source->stride;
+    guint8 *out = pixels + (gsize)y * width * 4;
+    for (int x = 0; x < width; x++) {
+      memcpy(out + x * 4, row + x * source->bpp, 3);
+      out[x * 4 + 3] = 255;
+    }
+  }
+
+  blur_rgba(pixels, width, height, radius);
+
+  GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
+      pixels, GDK_COLORSPACE_RGB, TRUE, 8, width, strip_height, width * 4,
+      NULL, NULL);
+  // g_file_set_contents writes through a unique temporary file, so
+  // instances saving the same strip don't clobber each other
+  gchar *cache_dir = g_path_get_dirname(path);
+  gchar *png = NULL;
+  gsize png_size = 0;
+  GError *error = NULL;
+  gboolean ok =
+      g_mkdir_with_parents(cache_dir, 0700) == 0 &&
+      gdk_pixbuf_save_to_buffer(pixbuf, &png, &png_size, "png", &error,
+                                NULL) &&
+      g_file_set_contents(path, png, png_size, &error);
+  if (!ok) {
+    g_printerr("Failed to write frosted bar background: %s\n",
+               error ? error->message : path);
+    g_clear_error(&error);
+    g_free(path);
+    path = NULL;
+  }
+
+  g_object_unref(pixbuf);
+  g_free(pixels);
+  g_free(png);
+  g_free(cache_dir);
+  return path;
+}
+
+static void free_bar_theme_update(BarThemeUpdate *update) {
+  g_free(update->frosted_path);
+  g_free(update);
+}
+
+// Main thread: restyle the bar with what the theme worker derived
+static gboolean apply_bar_theme(gpointer user_data) {
+  BarThemeUpdate *update = user_data;
+  TRACE_BEGIN("apply_bar_theme", "bar");
+
+  guint background[3];
+  sscanf(BAR_BACKGROUND_COLOR, "#%02x%02x%02x", &background[0],
+         &background[1], &background[2]);
+  if (update->has_palette) {
+    for (int c = 0; c < 3; c++)
+      background[c] = update->palette.dominant[c];
+  }
+
+  GString *css = g_string_new(NULL);
+  if (update->has_palette) {
+    // Dark text on light backgrounds, light text otherwise
+    const BarPalette *palette = &update->palette;
+    int luma = (palette->dominant[0] * 299 + palette->dominant[1] * 587 +
+                palette->dominant[2] * 114) /
+               1000;
+    g_string_append_printf(
+        css,
+        ".bar {"
+        "  background-color: rgba(%u, %u, %u, %.2f);"
+        "  border-color: rgba(%u, %u, %u, %.2f);"
+        "}"
+        ".bar label {"
+        "  color: %s;"
+        "}",
+        background[0], background[1], background[2], BAR_BACKGROUND_OPACITY,
+        palette->accent[0], palette->accent[1], palette->accent[2],
+        BAR_BACKGROUND_OPACITY,
+        luma > 150 ? BAR_AUTO_THEME_DARK_TEXT : BAR_AUTO_THEME_LIGHT_TEXT);
+  }
+
+  if (update->frosted_path != NULL) {
+    // The strip spans the whole output; line it up with where the bar sits
+    gchar *uri = g_filename_to_uri(update->frosted_path, NULL, NULL);
+    g_string_append_printf(
+        css,
+        ".bar {"
+        "  background-image: linear-gradient(rgba(%u, %u, %u, %.2f),"
+        "                                    rgba(%u, %u, %u, %.2f)),"
+        "                    url(\"%s\");"
+        "  background-size: auto, %dpx %dpx;"
+        "  background-position: 0 0, -%dpx -%dpx;"
+        "  background-repeat: no-repeat;"
+        "}",
+        background[0], background[1], background[2], BAR_FROSTED_TINT,
+        background[0], background[1], background[2], BAR_FROSTED_TINT, uri,
+        update->output_width,
+        BAR_PADDING_TOP + BAR_HEIGHT + BAR_PADDING_BOTTOM,
+        BAR_PADDING_HORIZONTAL, BAR_PADDING_TOP);
+    g_free(uri);
+  }
+
+  if (bar_theme_provider == NULL) {
+    bar_theme_provider = gtk_css_provider_new();
+    gtk_style_context_add_provider_for_display(
+        gdk_display_get_default(), GTK_STYLE_PROVIDER(bar_theme_provider),
+        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION + 1);
+  }
+  gtk_css_provider_load_from_string(bar_theme_provider, css->str);
+  g_string_free(css, TRUE);
+  free_bar_theme_update(update);
+
+  TRACE_END("apply_bar_theme");
+  return G_SOURCE_REMOVE;
+}
+
+// Theme worker thread: analyzes the most recently shown wallpaper. Palettes
+// and frosted strips are cached per image in memory and under
+// $XDG_CACHE_HOME.
+static gpointer bar_theme_worker_thread(gpointer user_data) {
+  BarThemeData *tdata = (BarThemeData *)user_data;
+
+  g_mutex_lock(&tdata->mutex);
+  tdata->thread_running = TRUE;
+  g_mutex_unlock(&tdata->mutex);
+
+  GKeyFile *cache = g_key_file_new();
+  gchar *cache_path = get_palette_cache_path();
+  g_key_file_load_from_file(cache, cache_path, G_KEY_FILE_NONE, NULL);
+  g_free(cache_path);
+
+  while (TRUE) {
+    g_mutex_lock(&tdata->mutex);
+    while (!tdata->should_stop && tdata->pending == NULL)
+      g_cond_wait(&tdata->cond, &tdata->mutex);
+    if (tdata->should_stop) {
+      g_mutex_unlock(&tdata->mutex);
+      break;
+    }
+    GdkTexture *texture = tdata->pending;
+    int output_width = tdata->output_width;
+    int output_height = tdata->output_height;
+    tdata->pending = NULL;
+    g_mutex_unlock(&tdata->mutex);
+
+    const WallpaperSource *source =
+        g_object_get_data(G_OBJECT(texture), "wallpaper-source");
+    gchar *key = source ? get_wallpaper_key(source->path) : NULL;
+    BarThemeUpdate *update = NULL;
+
+    if (key != NULL) {
+      update = g_new0(BarThemeUpdate, 1);
+      update->output_width = output_width;
+      update->output_height = output_height;
+    }
+
+    if (key != NULL && BAR_AUTO_THEME) {
+      update->has_palette = TRUE;
+      BarPalette *cached = g_hash_table_lookup(tdata->cache, key);
+      if (cached != NULL) {
+        update->palette = *cached;
+      } else {
+        if (!load_cached_palette(cache, key, &update->palette)) {
+          TRACE_BEGIN("compute_bar_palette", "bar");
+          compute_bar_palette(source, &update->palette);
+          TRACE_END("compute_bar_palette");
+          save_cached_palette(cache, key, &update->palette);
+        }
+        g_hash_table_insert(tdata->cache, g_strdup(key),
+                            g_memdup2(&update->palette, sizeof(BarPalette)));
+      }
+    }
+
+    if (key != NULL && BAR_FROSTED && output_width > 0 && output_height > 0) {
+      TRACE_BEGIN("compute_frosted_strip", "bar");
+      update->frosted_path =
+          compute_frosted_strip(source, key, output_width, output_height);
+      TRACE_END("compute_frosted_strip");
+    }
+
+    g_free(key);
+    g_object_unref(texture);
+    trim_heap("bar_theme");
+    if (update != NULL)
+      g_idle_add(apply_bar_theme, update);
+  }
+
+  g_key_file_free(cache);
+
+  g_mutex_lock(&tdata->mutex);
+  tdata->thread_running = FALSE;
+  g_mutex_unlock(&tdata->mutex);
+  return NULL;
+}
+
+static void refresh_bar_theme(void);
+
+static void on_bar_output_geometry(GObject *object, GParamSpec *pspec,
+                                   gpointer user_data) {
+  (void)object;
+  (void)pspec;
+  (void)user_data;
+  refresh_bar_theme();
+}
+
+static void on_bar_outputs_changed(GListModel *monitors, guint position,
+                                   guint removed, guint added,
+                                   gpointer user_data) {
+  (void)monitors;
+  (void)position;
+  (void)removed;
+  (void)added;
+  (void)user_data;
+  refresh_bar_theme();
+}
+
+static void on_bar_enter_monitor(GdkSurface *surface, GdkMonitor *monitor,
+                                 gpointer user_data) {
+  (void)surface;
+  (void)monitor;
+  (void)user_data;
+  refresh_bar_theme();
+}
+
+// Logical size of the output the bar is on (the first output until the bar
+// is mapped), watching that output for geometry changes
+static void get_bar_output_size(int *width, int *height) {
+  *width = 0;
+  *height = 0;
+
+  GdkMonitor *monitor = get_window_output(bar_window);
+  if (BAR_FROSTED && bar_theme_data != NULL)
+    watch_output(&bar_theme_data->output, monitor,
+                 G_CALLBACK(on_bar_output_geometry));
+  if (monitor == NULL)
+    return;
+
+  GdkRectangle geometry;
+  gdk_monitor_get_geometry(monitor, &geometry);
+  *width = geometry.width;
+  *height = geometry.height;
+}
+
+// Hand a wallpaper that was just put on screen to the theme worker. Only
+// the newest one matters, so a wallpaper still waiting is replaced.
+static void request_bar_theme(GdkTexture *texture) {
+  if (!BAR_AUTO_THEME && !BAR_FROSTED)
+    return;
+
+  if (bar_theme_data == NULL) {
+    bar_theme_data = g_new0(BarThemeData, 1);
+    bar_theme_data->cache =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_mutex_init(&bar_theme_data->mutex);
+    g_cond_init(&bar_theme_data->cond);
+
+    GError *error = NULL;
+    bar_theme_data->thread = g_thread_try_new(
+        "bar-theme-worker", bar_theme_worker_thread, bar_theme_data, &error);
+    if (bar_theme_data->thread == NULL) {
+      g_printerr("Failed to create bar theme thread: %s\n",
+                 error ? error->message : "Unknown error");
+      g_clear_error(&error);
+    }
+
+    if (BAR_FROSTED)
+      g_signal_connect(gdk_display_get_monitors(gdk_display_get_default()),
+                       "items-changed", G_CALLBACK(on_bar_outputs_changed),
+                       NULL);
+  }
+
+  // The frosted strip is cut to the output the bar spans
+  int output_width = 0, output_height = 0;
+  get_bar_output_size(&output_width, &output_height);
+
+  g_object_ref(texture);
+  if (bar_theme_data->current != NULL)
+    g_object_unref(bar_theme_data->current);
+  bar_theme_data->current = texture;
+  bar_theme_data->requested_width = output_width;
+  bar_theme_data->requested_height = output_height;
+
+  g_mutex_lock(&bar_theme_data->mutex);
+  if (bar_theme_data->pending != NULL)
+    g_object_unref(bar_theme_data->pending);
+  bar_theme_data->pending = g_object_ref(texture);
+  bar_theme_data->output_width = output_width;
+  bar_theme_data->output_height = output_height;
+  g_cond_signal(&bar_theme_data->cond);
+  g_mutex_unlock(&bar_theme_data->mutex);
+}
+
+// Cut the frosted strip again for the wallpaper on screen when the bar's
+// output was resized or the bar moved to another output
+static void refresh_bar_theme(void) {
+  if (!BAR_FROSTED || bar_theme_data == NULL ||
+      bar_theme_data->current == NULL)
+    return;
+
+  int width, height;
+  get_bar_output_size(&width, &height);
+  if (width != bar_theme_data->requested_width ||
+      height != bar_theme_data->requested_height)
+    request_bar_theme(bar_theme_data->current);
+}
+
+// Follow the bar's surface from output to output
+static void watch_bar_output(GtkWidget *window) {
+  bar_window = window;
+  GdkSurface *surface = gtk_native_get_surface(GTK_NATIVE(window));
+  if (surface != NULL)
+    g_signal_connect(surface, "enter-monitor",
+                     G_CALLBACK(on_bar_enter_monitor), NULL);
+  refresh_bar_theme();
+}
+
+static void stop_bar_theme(void) {
+  if (bar_theme_data == NULL)
+    return;
+
+  if (BAR_FROSTED)
+    g_signal_handlers_disconnect_by_func(
+        gdk_display_get_monitors(gdk_display_get_default()),
+        on_bar_outputs_changed, NULL);
+  unwatch_output(&bar_theme_data->output);
+  g_clear_object(&bar_theme_data->current);
+
+  g_mutex_lock(&bar_theme_data->mutex);
+  GThread *thread = bar_theme_data->thread;
+  bar_theme_data->should_stop = TRUE;
+  g_cond_signal(&bar_theme_data->cond);
+  bar_theme_data->thread = NULL;
+  g_mutex_unlock(&bar_theme_data->mutex);
+
+  if (thread != NULL)
+    g_thread_join(thread);
+
+  if (bar_theme_data->pending != NULL)
+    g_object_unref(bar_theme_data->pending);
+  g_hash_table_destroy(bar_theme_data->cache);
+  g_cond_clear(&bar_theme_data->cond);
+  g_mutex_clear(&bar_theme_data->mutex);
+  g_free(bar_theme_data);
+  bar_theme_data = NULL;
+
+  g_clear_object(&bar_theme_provider);
+}
+
+// Put a wallpaper on screen and let the bar theme follow it
+static void show_wallpaper(GtkWidget *picture, GdkTexture *texture) {
+  gtk_picture_set_paintable(GTK_PICTURE(picture), GDK_PAINTABLE(texture));
+  request_bar_theme(texture);
+}
+
+// Show the next prefetched wallpaper; only swaps the picture's texture
+static void show_next_slide(SlideshowData *sdata) {
+  g_mutex_lock(&sdata->mutex);
+  GdkTexture *texture = g_queue_pop_head(sdata->ready);
+  if (texture != NULL) {
+    sdata->showing = TRUE;
+    sdata->shown_path = GPOINTER_TO_UINT(
+        g_object_get_data(G_OBJECT(texture), "slideshow-path"));
+    g_cond_signal(&sdata->cond); // Room for the worker to prefetch another
+  }
+  g_mutex_unlock(&sdata->mutex);
+
+  if (texture != NULL) {
+    show_wallpaper(sdata->picture, texture);
+    g_object_unref(texture);
+  }
+}
+
+static gboolean on_slideshow_timeout(gpointer user_data) {
+  show_next_slide((SlideshowData *)user_data);
+  return G_SOURCE_CONTINUE;
+}
+
+// Idle callback to show the first wallpaper as soon as it is decoded
+static gboolean show_first_slide(gpointer user_data) {
+  SlideshowData *sdata = (SlideshowData *)user_data;
+  if (sdata == slideshow_data && !sdata->showing)
+    show_next_slide(sdata);
+  return G_SOURCE_REMOVE;
+}
+
+// Slideshow worker thread: keeps up to max_frames - 1 upcoming wallpapers
+// decoded and scaled to the output size
+static gpointer slideshow_worker_thread(gpointer user_data) {
+  SlideshowData *sdata = (SlideshowData *)user_data;
+  guint failures = 0;
+  gboolean decoded = FALSE;
+  guint decoded_generation = 0;
+
+  g_mutex_lock(&sdata->mutex);
+  sdata->thread_running = TRUE;
+  g_mutex_unlock(&sdata->mutex);
+
+  while (TRUE) {
+    g_mutex_lock(&sdata->mutex);
+
+    // Wait until a frame is consumed; if every image failed to load, retry
+    // after one slideshow interval instead of spinning. A single wallpaper
+    // is decoded only once per output size.
+    gint64 retry_time =
+        g_get_monotonic_time() + (gint64)slideshow_interval * G_USEC_PER_SEC;
+    while (!sdata->should_stop &&
+           (g_queue_get_length(sdata->ready) >= sdata->max_frames - 1 ||
+            failures >= sdata->n_paths ||
+            (sdata->n_paths == 1 && decoded &&
+             decoded_generation == sdata->generation))) {
+      if (failures < sdata->n_paths) {
+        g_cond_wait(&sdata->cond, &sdata->mutex);
+      } else if (!g_cond_wait_until(&sdata->cond, &sdata->mutex,
+                                    retry_time)) {
+        failures = 0;
+      }
+    }
+
+    if (sdata->should_stop) {
+      g_mutex_unlock(&sdata->mutex);
+      break;
+    }
 
-    if (day != NULL || month != NULL || day_num != NULL) {
-      g_mutex_lock(&ddata->mutex);
+    guint index = sdata->next_path;
+    const gchar *path = sdata->paths[index];
+    sdata->next_path = (sdata->next_path + 1) % sdata->n_paths;
+    guint generation = sdata->generation;
+    int width = sdata->width;
+    int height = sdata->height;
+    g_mutex_unlock(&sdata->mutex);
+
+    GError *error = NULL;
+    GdkTexture *texture = load_wallpaper_texture(path, width, height, &error);
+    if (texture == NULL) {
+      g_printerr("Failed to load image: %s: %s\n", path,
+                 error ? error->message : "Unknown error");
+      g_clear_error(&error);
+      failures++;
+      continue;
+    }
+    failures = 0;
+    decoded = TRUE;
+    decoded_generation = generation;
+    g_object_set_data(G_OBJECT(texture), "slideshow-path",
+                      GUINT_TO_POINTER(index));
+
+    trim_heap("wallpaper");
+
+    g_mutex_lock(&sdata->mutex);
+    if (generation != sdata->generation) {
+      // The output was resized while decoding; this frame has the old size
+      g_mutex_unlock(&sdata->mutex);
+      g_object_unref(texture);
+      continue;
+    }
+    g_queue_push_tail(sdata->ready, texture);
+    gboolean first = !sdata->showing && g_queue_get_length(sdata->ready) == 1;
+    g_mutex_unlock(&sdata->mutex);
 
-      gboolean day_changed = FALSE;
-      gboolean month_changed = FALSE;
-      gboolean day_number_changed = FALSE;
+    if (first)
+      g_idle_add(show_first_slide, sdata);
+  }
 
-      if (day != NULL && (ddata->previous_day == NULL ||
-                          strcmp(ddata->previous_day, day) != 0)) {
-        day_changed = TRUE;
-        g_free(ddata->previous_day);
-        ddata->previous_day = g_strdup(day);
+  g_mutex_lock(&sdata->mutex);
+  sdata->thread_running = FALSE;
+  g_cond_signal(&sdata->cond);
+  g_mutex_unlock(&sdata->mutex);
+
+  return NULL;
+}
+
+// Start rotating wallpapers on the given picture. Returns FALSE if there is
+// nothing to show.
+static gboolean start_slideshow(GtkWidget *picture) {
+  gchar **paths = collect_slideshow_paths();
+  if (paths[0] == NULL) {
+    g_printerr("No wallpapers found for slideshow\n");
+    g_strfreev(paths);
+    return FALSE;
+  }
+
+  slideshow_data = g_malloc0(sizeof(SlideshowData));
+  slideshow_data->picture = picture;
+  slideshow_data->paths = paths;
+  slideshow_data->n_paths = g_strv_length(paths);
+  slideshow_data->max_frames =
+      low_memory_mode ? 2 : MAX(SLIDESHOW_MAX_FRAMES, 2);
+  slideshow_data->ready = g_queue_new();
+  get_output_size(&slideshow_data->width, &slideshow_data->height);
+  g_mutex_init(&slideshow_data->mutex);
+  g_cond_init(&slideshow_data->cond);
+
+  GError *error = NULL;
+  slideshow_data->thread = g_thread_try_new(
+      "slideshow-worker", slideshow_worker_thread, slideshow_data, &error);
+  if (slideshow_data->thread == NULL) {
+    g_printerr("Failed to create slideshow thread: %s\n",
+               error ? error->message : "Unknown error");
+    if (error)
+      g_error_free(error);
+    return FALSE;
+  }
+
+  if (slideshow_data->n_paths > 1) {
+    slideshow_data->timeout_id = g_timeout_add_seconds(
+        MAX(slideshow_interval, 1), on_slideshow_timeout, slideshow_data);
+  }
+  return TRUE;
+}
+
+// Decode the wallpapers again when the background's output was resized or
+// the background moved to another output. Prefetched frames have the old
+// size, so they are dropped and the one on screen is decoded first.
+static void refresh_wallpaper_size(void) {
+  int width, height;
+  get_output_size(&width, &height);
+
+  // The cached wallpaper was looked up before the background was mapped;
+  // if it landed on an output of another size, decode it for that one
+  if (slideshow_data == NULL && cached_wallpaper_picture != NULL &&
+      (width != cached_wallpaper_width ||
+       height != cached_wallpaper_height)) {
+    GtkWidget *picture = cached_wallpaper_picture;
+    cached_wallpaper_picture = NULL;
+    start_slideshow(picture);
+    return;
+  }
+
+  if (slideshow_data == NULL)
+    return;
+
+  SlideshowData *sdata = slideshow_data;
+  g_mutex_lock(&sdata->mutex);
+  if (width != sdata->width || height != sdata->height) {
+    sdata->width = width;
+    sdata->height = height;
+    sdata->generation++;
+
+    GdkTexture *texture;
+    while ((texture = g_queue_pop_head(sdata->ready)) != NULL)
+      g_object_unref(texture);
+    if (sdata->showing)
+      sdata->next_path = sdata->shown_path;
+    sdata->showing = FALSE; // Show the re-decoded frame as soon as it is ready
+    g_cond_signal(&sdata->cond);
+  }
+  g_mutex_unlock(&sdata->mutex);
+}
+
+static void on_background_outputs_changed(GListModel *monitors,
+                                          guint position, guint removed,
+                                          guint added, gpointer user_data) {
+  (void)monitors;
+  (void)position;
+  (void)removed;
+  (void)added;
+  (void)user_data;
+  refresh_wallpaper_size();
+}
+
+static void on_background_enter_monitor(GdkSurface *surface,
+                                        GdkMonitor *monitor,
+                                        gpointer user_data) {
+  (void)surface;
+  (void)monitor;
+  (void)user_data;
+  refresh_wallpaper_size();
+}
+
+// Follow the background's surface from output to output
+static void watch_background_output(GtkWidget *window) {
+  GdkSurface *surface = gtk_native_get_surface(GTK_NATIVE(window));
+  if (surface != NULL)
+    g_signal_connect(surface, "enter-monitor",
+                     G_CALLBACK(on_background_enter_monitor), NULL);
+  g_signal_connect(gdk_display_get_monitors(gdk_display_get_default()),
+                   "items-changed",
+                   G_CALLBACK(on_background_outputs_changed), NULL);
+  refresh_wallpaper_size();
+}
+
+// Async-signal-safe handler: forward the signal offset to the main loop
+static void refresh_signal_handler(int signum) {
+  int saved_errno = errno;
+  unsigned char offset = (unsigned char)(signum - SIGRTMIN);
+  if (write(refresh_signal_pipe[1], &offset, 1) < 0) {
+    // Pipe full - a refresh for this signal is already pending
+  }
+  errno = saved_errno;
+}
+
+// Wake a module worker so it re-runs its command immediately
+static void request_module_refresh(BarItemData *item_data) {
+  g_mutex_lock(&item_data->mutex);
+  if (item_data->thread != NULL) {
+    item_data->refresh_requested = TRUE;
+    g_cond_signal(&item_data->cond);
+  }
+  g_mutex_unlock(&item_data->mutex);
+}
+
+// Main loop callback: dispatch pending refresh signals to their modules
+static gboolean on_refresh_signal(gint fd, GIOCondition condition,
+                                  gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  unsigned char offsets[64];
+  ssize_t count;
+  while ((count = read(fd, offsets, sizeof(offsets))) > 0) {
+    for (ssize_t n = 0; n < count; n++) {
+      for (size_t i = 0; i < BAR_ITEMS_COUNT && bar_items_data != NULL; i++) {
+        if (bar_items_data[i].signal == offsets[n] &&
+            strcmp(bar_items_data[i].command, "<separator>") != 0) {
+          request_module_refresh(&bar_items_data[i]);
+        }
       }
+    }
+  }
 
-      if (month != NULL && (ddata->previous_month == NULL ||
-                            strcmp(ddata->previous_month, month) != 0)) {
-        month_changed = TRUE;
-        g_free(ddata->previous_month);
-        ddata->previous_month = g_strdup(month);
+  return G_SOURCE_CONTINUE;
+}
+
+// Install SIGRTMIN+N handlers for every bar item that requests one
+static void setup_refresh_signals(void) {
+  gboolean needed = FALSE;
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    if (BAR_ITEMS[i].signal > 0)
+      needed = TRUE;
+  }
+  if (!needed)
+    return;
+
+  if (pipe2(refresh_signal_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    g_printerr("Failed to create refresh signal pipe: %s\n",
+               g_strerror(errno));
+    return;
+  }
+  refresh_signal_source_id =
+      g_unix_fd_add(refresh_signal_pipe[0], G_IO_IN, on_refresh_signal, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = refresh_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    int offset = BAR_ITEMS[i].signal;
+    if (offset <= 0)
+      continue;
+    if (SIGRTMIN + offset > SIGRTMAX) {
+      g_printerr("Refresh signal SIGRTMIN+%d for module %zu is out of range\n",
+                 offset, i);
+      continue;
+    }
+    sigaction(SIGRTMIN + offset, &action, NULL);
+  }
+}
+
+// Restore default signal dispositions and close the self-pipe
+static void cleanup_refresh_signals(void) {
+  if (refresh_signal_pipe[0] < 0)
+    return;
+
+  // Ignore late signals rather than letting them terminate the process
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    int offset = BAR_ITEMS[i].signal;
+    if (offset > 0 && SIGRTMIN + offset <= SIGRTMAX)
+      signal(SIGRTMIN + offset, SIG_IGN);
+  }
+
+  if (refresh_signal_source_id != 0) {
+    g_source_remove(refresh_signal_source_id);
+    refresh_signal_source_id = 0;
+  }
+  close(refresh_signal_pipe[0]);
+  close(refresh_signal_pipe[1]);
+  refresh_signal_pipe[0] = -1;
+  refresh_signal_pipe[1] = -1;
+}
+
+// First line of a power_supply attribute, or NULL
+static gchar *read_power_supply(const char *name, const char *attribute) {
+  gchar *path =
+      g_build_filename("/sys/class/power_supply", name, attribute, NULL);
+  gchar *value = NULL;
+  if (g_file_get_contents(path, &value, NULL, NULL))
+    value[strcspn(value, "\n")] = '\0';
+  g_free(path);
+  return value;
+}
+
+// Whether the machine runs on battery: a system battery is discharging and
+// no mains or USB supply is online. Batteries of wireless mice, keyboards
+// and headsets (scope "Device") report "Discharging" all the time and are
+// ignored.
+static gboolean is_on_battery(void) {
+  GDir *dir = g_dir_open("/sys/class/power_supply", 0, NULL);
+  if (dir == NULL)
+    return FALSE;
+
+  gboolean discharging = FALSE, plugged_in = FALSE;
+  const gchar *name;
+  while (!plugged_in && (name = g_dir_read_name(dir)) != NULL) {
+    gchar *type = read_power_supply(name, "type");
+    if (type == NULL)
+      continue;
+
+    if (strcmp(type, "Mains") == 0 || strcmp(type, "USB") == 0) {
+      gchar *online = read_power_supply(name, "online");
+      plugged_in = online != NULL && strcmp(online, "1") == 0;
+      g_free(online);
+    } else if (strcmp(type, "Battery") == 0) {
+      gchar *scope = read_power_supply(name, "scope");
+      gchar *status = read_power_supply(name, "status");
+      if ((scope == NULL || strcmp(scope, "Device") != 0) && status != NULL &&
+          strcmp(status, "Discharging") == 0)
+        discharging = TRUE;
+      g_free(scope);
+      g_free(status);
+    }
+    g_free(type);
+  }
+
+  g_dir_close(dir);
+  return discharging && !plugged_in;
+}
+
+// "some avg10" of a PSI resource: the share of the last 10 seconds in which
+// at least one task stalled on it, in percent (0 without PSI)
+static double read_pressure(const char *resource) {
+  gchar *path = g_build_filename("/proc/pressure", resource, NULL);
+  gchar *contents = NULL;
+  double avg10 = 0;
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    const char *some = strstr(contents, "some avg10=");
+    if (some != NULL)
+      avg10 = g_ascii_strtod(some + strlen("some avg10="), NULL);
+  }
+  g_free(contents);
+  g_free(path);
+  return avg10;
+}
+
+// Wake a worker so it recomputes the wait in progress
+static void wake_worker(GMutex *mutex, GCond *cond) {
+  g_mutex_lock(mutex);
+  g_cond_signal(cond);
+  g_mutex_unlock(mutex);
+}
+
+// Main loop callback: pick the scheduling profile and apply its interval
+// scale to every worker without restarting them
+static gboolean on_profile_check(gpointer user_data) {
+  (void)user_data;
+
+  double pressure = MAX(read_pressure("cpu"), read_pressure("memory"));
+  SchedulingProfile profile;
+  if (pressure >= PRESSURE_HIGH ||
+      (scheduling_profile == PROFILE_PRESSURE && pressure > PRESSURE_LOW))
+    profile = PROFILE_PRESSURE;
+  else if (is_on_battery())
+    profile = PROFILE_BATTERY;
+  else
+    profile = PROFILE_NORMAL;
+
+  if (profile == scheduling_profile)
+    return G_SOURCE_CONTINUE;
+
+  static const char *names[] = {"normal", "battery", "pressure"};
+  static const int scales[] = {1, BATTERY_INTERVAL_SCALE,
+                               PRESSURE_INTERVAL_SCALE};
+  scheduling_profile = profile;
+  g_atomic_int_set(&interval_scale, MAX(scales[profile], 1));
+  TRACE_INSTANT("scheduling_profile", names[profile]);
+
+  // Waits past their new end run at once; none runs before its unscaled
+  // interval
+  for (size_t i = 0; i < BAR_ITEMS_COUNT && bar_items_data != NULL; i++) {
+    BarItemData *item_data = &bar_items_data[i];
+    if (strcmp(item_data->command, "<separator>") != 0)
+      wake_worker(&item_data->mutex, &item_data->cond);
+  }
+  if (weather_data != NULL)
+    wake_worker(&weather_data->mutex, &weather_data->cond);
+  if (date_data != NULL)
+    wake_worker(&date_data->mutex, &date_data->cond);
+
+  return G_SOURCE_CONTINUE;
+}
+
+// Follow power and pressure state for the workers' intervals
+static void start_profile_checks(void) {
+  if (PROFILE_CHECK_INTERVAL <= 0 || profile_check_id != 0)
+    return;
+
+  on_profile_check(NULL);
+  profile_check_id = g_timeout_add_seconds(PROFILE_CHECK_INTERVAL,
+                                           on_profile_check, NULL);
+}
+
+static void stop_profile_checks(void) {
+  if (profile_check_id != 0) {
+    g_source_remove(profile_check_id);
+    profile_check_id = 0;
+  }
+}
+
+// Paths a bar item watches: its watch list, or the file it reads
+static gchar **get_module_watch_paths(const BarItem *item) {
+  if (item->watch != NULL)
+    return g_strsplit(item->watch, ":", -1);
+  if (g_str_has_prefix(item->command, MODULE_FILE_PREFIX)) {
+    gchar **paths = g_new0(gchar *, 2);
+    paths[0] = g_strdup(item->command + strlen(MODULE_FILE_PREFIX));
+    return paths;
+  }
+  return NULL;
+}
+
+static gboolean module_has_triggers(const BarItem *item) {
+  return item->watch != NULL || item->uevent != NULL ||
+         g_str_has_prefix(item->command, MODULE_FILE_PREFIX);
+}
+
+// Main loop callback: refresh the bar items whose watched paths changed
+static gboolean on_inotify_event(gint fd, GIOCondition condition,
+                                 gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + length;
+         p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+
+      for (guint i = 0; i < module_watches->len; i++) {
+        ModuleWatch *watch = &g_array_index(module_watches, ModuleWatch, i);
+        if (watch->wd == event->wd &&
+            (watch->name == NULL ||
+             (event->len > 0 && strcmp(watch->name, event->name) == 0)))
+          request_module_refresh(watch->item_data);
       }
+    }
+  }
 
-      if (day_num != NULL &&
-          (ddata->previous_day_number == NULL ||
-           strcmp(ddata->previous_day_number, day_num) != 0)) {
-        day_number_changed = TRUE;
-        g_free(ddata->previous_day_number);
-        ddata->previous_day_number = g_strdup(day_num);
+  return G_SOURCE_CONTINUE;
+}
+
+// Main loop callback: refresh the bar items subscribed to a uevent's
+// subsystem. Messages are "action@devpath" followed by KEY=value strings.
+static gboolean on_uevent(gint fd, GIOCondition condition,
+                          gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  char buffer[8192];
+  ssize_t length;
+  while ((length = recv(fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+    buffer[length] = '\0';
+    const char *subsystem = NULL;
+    for (char *p = buffer; p < buffer + length; p += strlen(p) + 1) {
+      if (g_str_has_prefix(p, "SUBSYSTEM="))
+        subsystem = p + strlen("SUBSYSTEM=");
+    }
+    if (subsystem == NULL)
+      continue;
+
+    for (size_t i = 0; i < BAR_ITEMS_COUNT && bar_items_data != NULL; i++) {
+      if (BAR_ITEMS[i].uevent != NULL &&
+          strcmp(BAR_ITEMS[i].uevent, subsystem) == 0)
+        request_module_refresh(&bar_items_data[i]);
+    }
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void add_module_watch(const char *path, BarItemData *item_data) {
+  // Watch directories themselves and files through their parent
+  gboolean is_dir = g_file_test(path, G_FILE_TEST_IS_DIR);
+  gchar *dir = is_dir ? g_strdup(path) : g_path_get_dirname(path);
+
+  int wd = inotify_add_watch(inotify_fd, dir,
+                             IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                 IN_CREATE | IN_DELETE | IN_MOVED_TO |
+                                 IN_MOVED_FROM);
+  if (wd < 0) {
+    g_printerr("Failed to watch %s for module %s: %s\n", dir,
+               item_data->command, g_strerror(errno));
+    g_free(dir);
+    return;
+  }
+
+  ModuleWatch watch = {.wd = wd,
+                       .name = is_dir ? NULL : g_path_get_basename(path),
+                       .item_data = item_data};
+  g_array_append_val(module_watches, watch);
+  g_free(dir);
+}
+
+// Set up inotify watches and the uevent socket for bar items with triggers
+static void setup_module_triggers(void) {
+  gboolean needs_uevent = FALSE;
+
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    gchar **paths = get_module_watch_paths(&BAR_ITEMS[i]);
+    if (BAR_ITEMS[i].uevent != NULL)
+      needs_uevent = TRUE;
+    if (paths == NULL)
+      continue;
+
+    if (inotify_fd < 0) {
+      inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (inotify_fd < 0) {
+        g_printerr("Failed to initialize inotify: %s\n", g_strerror(errno));
+        g_strfreev(paths);
+        continue;
       }
+      module_watches = g_array_new(FALSE, FALSE, sizeof(ModuleWatch));
+      inotify_source_id =
+          g_unix_fd_add(inotify_fd, G_IO_IN, on_inotify_event, NULL);
+    }
 
-      if (day_changed || month_changed || day_number_changed) {
-        GtkWidget *day_widget = ddata->day_widget;
-        GtkWidget *month_widget = ddata->month_widget;
-        GtkWidget *day_number_widget = ddata->day_number_widget;
+    for (gchar **path = paths; *path != NULL; path++) {
+      if (**path != '\0')
+        add_module_watch(*path, &bar_items_data[i]);
+    }
+    g_strfreev(paths);
+  }
 
-        DateUpdateData *update_data = g_malloc(sizeof(DateUpdateData));
-        update_data->day_widget = day_widget;
-        update_data->month_widget = month_widget;
-        update_data->day_number_widget = day_number_widget;
-        update_data->new_day = day_changed && day ? g_strdup(day) : NULL;
-        update_data->new_month =
-            month_changed && month ? g_strdup(month) : NULL;
-        update_data->new_day_number =
-            day_number_changed && day_num ? g_strdup(day_num) : NULL;
+  if (!needs_uevent)
+    return;
+
+  uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_KOBJECT_UEVENT);
+  struct sockaddr_nl address = {.nl_family = AF_NETLINK,
+                                .nl_groups = 1}; // Kernel events
+  if (uevent_fd < 0 ||
+      bind(uevent_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    g_printerr("Failed to open uevent socket: %s\n", g_strerror(errno));
+    if (uevent_fd >= 0)
+      close(uevent_fd);
+    uevent_fd = -1;
+    return;
+  }
+  uevent_source_id = g_unix_fd_add(uevent_fd, G_IO_IN, on_uevent, NULL);
+}
 
-        g_mutex_unlock(&ddata->mutex);
+static void cleanup_module_triggers(void) {
+  if (inotify_source_id != 0) {
+    g_source_remove(inotify_source_id);
+    inotify_source_id = 0;
+  }
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  if (module_watches != NULL) {
+    for (guint i = 0; i < module_watches->len; i++)
+      g_free(g_array_index(module_watches, ModuleWatch, i).name);
+    g_array_free(module_watches, TRUE);
+    module_watches = NULL;
+  }
 
-        g_idle_add(update_date_ui_from_main_thread, update_data);
-      } else {
-        g_mutex_unlock(&ddata->mutex);
+  if (uevent_source_id != 0) {
+    g_source_remove(uevent_source_id);
+    uevent_source_id = 0;
+  }
+  if (uevent_fd >= 0) {
+    close(uevent_fd);
+    uevent_fd = -1;
+  }
+}
+
+// Show new output for a bar item driven from the main loop rather than a
+// worker thread
+static void publish_bar_output(BarItemData *item_data, const gchar *output) {
+  g_mutex_lock(&item_data->mutex);
+  gboolean changed = g_strcmp0(item_data->previous_output, output) != 0;
+  if (changed) {
+    g_free(item_data->previous_output);
+    item_data->previous_output = g_strdup(output);
+  }
+  g_mutex_unlock(&item_data->mutex);
+
+  if (!changed)
+    return;
+
+  if (engine_only) {
+    emit_module_update(item_data->id, output);
+  } else {
+    set_bar_label_text(item_data->widget, output);
+    track_frame_update(item_data->widget, item_data->stats,
+                       g_get_monotonic_time());
+  }
+}
+
+static void free_mpris_player(gpointer data) {
+  MprisPlayer *player = data;
+  g_free(player->bus_name);
+  g_free(player->owner);
+  g_free(player->status);
+  g_free(player->title);
+  g_free(player->artist);
+  g_free(player);
+}
+
+// Render the most relevant player (playing before paused) into every
+// "<mpris>" item
+static void update_mpris_items(void) {
+  MprisPlayer *best = NULL;
+  int best_rank = 0;
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, mpris_data->players);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    MprisPlayer *player = value;
+    int rank = g_strcmp0(player->status, "Playing") == 0  ? 2
+               : g_strcmp0(player->status, "Paused") == 0 ? 1
+                                                          : 0;
+    if (rank > best_rank && player->title != NULL && *player->title != '\0') {
+      best = player;
+      best_rank = rank;
+    }
+  }
+
+  gchar *text;
+  if (best == NULL)
+    text = g_strdup("");
+  else if (best->artist != NULL && *best->artist != '\0')
+    text = g_strdup_printf(
+        "%s %s - %s", best_rank == 2 ? MPRIS_PLAYING_ICON : MPRIS_PAUSED_ICON,
+        best->artist, best->title);
+  else
+    text = g_strdup_printf(
+        "%s %s", best_rank == 2 ? MPRIS_PLAYING_ICON : MPRIS_PAUSED_ICON,
+        best->title);
+
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    if (strcmp(bar_items_data[i].command, MODULE_MPRIS) == 0)
+      publish_bar_output(&bar_items_data[i], text);
+  }
+  g_free(text);
+}
+
+// Apply an a{sv} of org.mpris.MediaPlayer2.Player properties
+static void update_mpris_player(MprisPlayer *player, GVariant *properties) {
+  GVariantIter iter;
+  const gchar *key;
+  GVariant *value;
+
+  g_variant_iter_init(&iter, properties);
+  while (g_variant_iter_loop(&iter, "{&sv}", &key, &value)) {
+    if (strcmp(key, "PlaybackStatus") == 0 &&
+        g_variant_is_of_type(value, G_VARIANT_TYPE_STRING)) {
+      g_free(player->status);
+      player->status = g_variant_dup_string(value, NULL);
+    } else if (strcmp(key, "Metadata") == 0 &&
+               g_variant_is_of_type(value, G_VARIANT_TYPE_VARDICT)) {
+      g_clear_pointer(&player->title, g_free);
+      g_clear_pointer(&player->artist, g_free);
+      g_variant_lookup(value, "xesam:title", "s", &player->title);
+
+      const gchar **artists = NULL;
+      if (g_variant_lookup(value, "xesam:artist", "^a&s", &artists)) {
+        player->artist = g_strjoinv(", ", (gchar **)artists);
+        g_free(artists);
+      }
+    }
+  }
+}
+
+static void on_mpris_properties(GObject *source, GAsyncResult *result,
+                                gpointer user_data) {
+  gchar *bus_name = user_data;
+  GError *error = NULL;
+  GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source),
+                                                  result, &error);
+  if (reply == NULL) {
+    g_error_free(error);
+    g_free(bus_name);
+    return;
+  }
+
+  // The player may have gone away while the call was in flight
+  MprisPlayer *player = g_hash_table_lookup(mpris_data->players, bus_name);
+  if (player != NULL) {
+    GVariant *properties = g_variant_get_child_value(reply, 0);
+    update_mpris_player(player, properties);
+    g_variant_unref(properties);
+    update_mpris_items();
+  }
+
+  g_variant_unref(reply);
+  g_free(bus_name);
+}
+
+// Track a player under its unique name and fetch its current state
+static void add_mpris_player(const gchar *bus_name, const gchar *owner) {
+  MprisPlayer *player = g_new0(MprisPlayer, 1);
+  player->bus_name = g_strdup(bus_name);
+  player->owner = g_strdup(owner);
+  g_hash_table_replace(mpris_data->players, player->bus_name, player);
+
+  g_dbus_connection_call(mpris_data->connection, bus_name, MPRIS_PATH,
+                         "org.freedesktop.DBus.Properties", "GetAll",
+                         g_variant_new("(s)", MPRIS_PLAYER_INTERFACE),
+                         G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, -1,
+                         mpris_data->cancellable, on_mpris_properties,
+                         g_strdup(bus_name));
+}
+
+static void on_mpris_name_owner(GObject *source, GAsyncResult *result,
+                                gpointer user_data) {
+  gchar *bus_name = user_data;
+  GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source),
+                                                  result, NULL);
+  if (reply != NULL) {
+    const gchar *owner;
+    g_variant_get(reply, "(&s)", &owner);
+    add_mpris_player(bus_name, owner);
+    g_variant_unref(reply);
+  }
+  g_free(bus_name);
+}
+
+static void on_mpris_list_names(GObject *source, GAsyncResult *result,
+                                gpointer user_data) {
+  (void)user_data;
+  GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source),
+                                                  result, NULL);
+  if (reply == NULL)
+    return;
+
+  GVariantIter *iter;
+  const gchar *name;
+  g_variant_get(reply, "(as)", &iter);
+  while (g_variant_iter_loop(iter, "&s", &name)) {
+    if (!g_str_has_prefix(name, MPRIS_PREFIX))
+      continue;
+    g_dbus_connection_call(mpris_data->connection, "org.freedesktop.DBus",
+                           "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                           "GetNameOwner", g_variant_new("(s)", name),
+                           G_VARIANT_TYPE("(s)"), G_DBUS_CALL_FLAGS_NONE, -1,
+                           mpris_data->cancellable, on_mpris_name_owner,
+                           g_strdup(name));
+  }
+  g_variant_iter_free(iter);
+  g_variant_unref(reply);
+}
+
+// Players appearing and disappearing on the bus
+static void on_mpris_owner_changed(GDBusConnection *connection,
+                                   const gchar *sender, const gchar *path,
+                                   const gchar *interface, const gchar *signal,
+                                   GVariant *parameters, gpointer user_data) {
+  (void)connection;
+  (void)sender;
+  (void)path;
+  (void)interface;
+  (void)signal;
+  (void)user_data;
+
+  const gchar *name, *old_owner, *new_owner;
+  g_variant_get(parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+  if (!g_str_has_prefix(name, MPRIS_PREFIX))
+    return;
+
+  if (*new_owner == '\0') {
+    g_hash_table_remove(mpris_data->players, name);
+    update_mpris_items();
+  } else {
+    add_mpris_player(name, new_owner);
+  }
+}
+
+static void on_mpris_properties_changed(GDBusConnection *connection,
+                                        const gchar *sender, const gchar *path,
+                                        const gchar *interface,
+                                        const gchar *signal,
+                                        GVariant *parameters,
+                                        gpointer user_data) {
+  (void)connection;
+  (void)path;
+  (void)interface;
+  (void)signal;
+  (void)user_data;
+
+  const gchar *changed_interface;
+  GVariant *changed;
+  g_variant_get(parameters, "(&s@a{sv}@as)", &changed_interface, &changed,
+                NULL);
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, mpris_data->players);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    MprisPlayer *player = value;
+    if (g_strcmp0(player->owner, sender) == 0)
+      update_mpris_player(player, changed);
+  }
+  g_variant_unref(changed);
+  update_mpris_items();
+}
+
+static void on_mpris_bus(GObject *source, GAsyncResult *result,
+                         gpointer user_data) {
+  (void)source;
+  (void)user_data;
+  GError *error = NULL;
+  GDBusConnection *connection = g_bus_get_finish(result, &error);
+  if (connection == NULL) {
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_printerr("Failed to connect to the session bus: %s\n",
+                 error->message);
+    g_error_free(error);
+    return;
+  }
+  mpris_data->connection = connection;
+
+  mpris_data->owner_id = g_dbus_connection_signal_subscribe(
+      connection, "org.freedesktop.DBus", "org.freedesktop.DBus",
+      "NameOwnerChanged", "/org/freedesktop/DBus", "org.mpris.MediaPlayer2",
+      G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE, on_mpris_owner_changed, NULL,
+      NULL);
+  mpris_data->properties_id = g_dbus_connection_signal_subscribe(
+      connection, NULL, "org.freedesktop.DBus.Properties", "PropertiesChanged",
+      MPRIS_PATH, MPRIS_PLAYER_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE,
+      on_mpris_properties_changed, NULL, NULL);
+
+  g_dbus_connection_call(connection, "org.freedesktop.DBus",
+                         "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                         "ListNames", NULL, G_VARIANT_TYPE("(as)"),
+                         G_DBUS_CALL_FLAGS_NONE, -1, mpris_data->cancellable,
+                         on_mpris_list_names, NULL);
+}
+
+// Connect to the session bus once for all "<mpris>" items
+static void start_mpris(void) {
+  if (mpris_data != NULL)
+    return;
+
+  mpris_data = g_new0(MprisData, 1);
+  mpris_data->cancellable = g_cancellable_new();
+  mpris_data->players =
+      g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_mpris_player);
+  g_bus_get(G_BUS_TYPE_SESSION, mpris_data->cancellable, on_mpris_bus, NULL);
+}
+
+static void stop_mpris(void) {
+  if (mpris_data == NULL)
+    return;
+
+  // Pending calls complete with G_IO_ERROR_CANCELLED and touch nothing
+  g_cancellable_cancel(mpris_data->cancellable);
+  if (mpris_data->connection != NULL) {
+    g_dbus_connection_signal_unsubscribe(mpris_data->connection,
+                                         mpris_data->owner_id);
+    g_dbus_connection_signal_unsubscribe(mpris_data->connection,
+                                         mpris_data->properties_id);
+    g_object_unref(mpris_data->connection);
+  }
+  g_object_unref(mpris_data->cancellable);
+  g_hash_table_destroy(mpris_data->players);
+  g_free(mpris_data);
+  mpris_data = NULL;
+}
+
+static void free_net_interface(gpointer data) {
+  NetInterface *iface = data;
+  g_free(iface->name);
+  g_ptr_array_unref(iface->ipv4);
+  g_ptr_array_unref(iface->ipv6);
+  g_free(iface);
+}
+
+static NetInterface *get_net_interface(int index) {
+  NetInterface *iface =
+      g_hash_table_lookup(network_data->interfaces, GINT_TO_POINTER(index));
+  if (iface == NULL) {
+    iface = g_new0(NetInterface, 1);
+    iface->ipv4 = g_ptr_array_new_with_free_func(g_free);
+    iface->ipv6 = g_ptr_array_new_with_free_func(g_free);
+    g_hash_table_insert(network_data->interfaces, GINT_TO_POINTER(index),
+                        iface);
+  }
+  return iface;
+}
+
+static int compare_net_interfaces(gconstpointer a, gconstpointer b) {
+  const NetInterface *left = *(NetInterface *const *)a;
+  const NetInterface *right = *(NetInterface *const *)b;
+  return g_strcmp0(left->name, right->name);
+}
+
+// Render every interface that is up into the "<network>" items, e.g.
+// "wlan0 192.168.1.5 ↓1.2 MB/s ↑35.0 kB/s"
+static void update_network_items(void) {
+  GPtrArray *up = g_ptr_array_new();
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, network_data->interfaces);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    NetInterface *iface = value;
+    if (iface->up && !iface->loopback && iface->name != NULL)
+      g_ptr_array_add(up, iface);
+  }
+  g_ptr_array_sort(up, compare_net_interfaces);
+
+  GString *text = g_string_new(NULL);
+  for (guint i = 0; i < up->len; i++) {
+    NetInterface *iface = g_ptr_array_index(up, i);
+    const char *address = iface->ipv4->len > 0
+                              ? g_ptr_array_index(iface->ipv4, 0)
+                          : iface->ipv6->len > 0
+                              ? g_ptr_array_index(iface->ipv6, 0)
+                              : NULL;
+    gchar *rx = g_format_size((guint64)iface->rx_rate);
+    gchar *tx = g_format_size((guint64)iface->tx_rate);
+
+    if (text->len > 0)
+      g_string_append(text, "  ");
+    g_string_append(text, iface->name);
+    if (address != NULL)
+      g_string_append_printf(text, " %s", address);
+    g_string_append_printf(text, " ↓%s/s ↑%s/s", rx, tx);
+    g_free(rx);
+    g_free(tx);
+  }
+  if (text->len == 0)
+    g_string_append(text, NETWORK_DOWN_TEXT);
+  g_ptr_array_unref(up);
+
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    if (strcmp(bar_items_data[i].command, MODULE_NETWORK) == 0)
+      publish_bar_output(&bar_items_data[i], text->str);
+  }
+  g_string_free(text, TRUE);
+}
+
+static void request_network_dump(int type) {
+  struct {
+    struct nlmsghdr header;
+    struct rtgenmsg message;
+  } request = {
+      .header = {.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg)),
+                 .nlmsg_type = type,
+                 .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+                 .nlmsg_seq = ++network_data->sequence},
+      .message = {.rtgen_family = AF_UNSPEC},
+  };
+
+  if (send(network_data->fd, &request, request.header.nlmsg_len, 0) < 0)
+    g_printerr("Failed to query rtnetlink: %s\n", g_strerror(errno));
+}
+
+static void handle_link_message(struct nlmsghdr *header) {
+  struct ifinfomsg *info = NLMSG_DATA(header);
+  if (header->nlmsg_type == RTM_DELLINK) {
+    g_hash_table_remove(network_data->interfaces,
+                        GINT_TO_POINTER(info->ifi_index));
+    return;
+  }
+
+  NetInterface *iface = get_net_interface(info->ifi_index);
+  iface->up = (info->ifi_flags & IFF_UP) && (info->ifi_flags & IFF_RUNNING);
+  iface->loopback = (info->ifi_flags & IFF_LOOPBACK) != 0;
+
+  int length = IFLA_PAYLOAD(header);
+  for (struct rtattr *attr = IFLA_RTA(info); RTA_OK(attr, length);
+       attr = RTA_NEXT(attr, length)) {
+    if (attr->rta_type == IFLA_IFNAME) {
+      g_free(iface->name);
+      iface->name = g_strndup(RTA_DATA(attr), RTA_PAYLOAD(attr));
+    }
+  }
+}
+
+static void handle_address_message(struct nlmsghdr *header) {
+  struct ifaddrmsg *info = NLMSG_DATA(header);
+  if (info->ifa_family != AF_INET && info->ifa_family != AF_INET6)
+    return;
+  // Link-local and host-scoped IPv6 addresses are not interesting here
+  if (info->ifa_family == AF_INET6 && info->ifa_scope != RT_SCOPE_UNIVERSE)
+    return;
+
+  const void *address = NULL;
+  int length = IFA_PAYLOAD(header);
+  for (struct rtattr *attr = IFA_RTA(info); RTA_OK(attr, length);
+       attr = RTA_NEXT(attr, length)) {
+    // IFA_LOCAL is the interface's own address on point-to-point links
+    if (attr->rta_type == IFA_LOCAL ||
+        (attr->rta_type == IFA_ADDRESS && address == NULL))
+      address = RTA_DATA(attr);
+  }
+  if (address == NULL)
+    return;
+
+  char buffer[INET6_ADDRSTRLEN];
+  if (inet_ntop(info->ifa_family, address, buffer, sizeof(buffer)) == NULL)
+    return;
+
+  NetInterface *iface = get_net_interface(info->ifa_index);
+  GPtrArray *addresses = info->ifa_family == AF_INET ? iface->ipv4
+                                                     : iface->ipv6;
+  for (guint i = 0; i < addresses->len; i++) {
+    if (strcmp(g_ptr_array_index(addresses, i), buffer) == 0) {
+      g_ptr_array_remove_index(addresses, i);
+      break;
+    }
+  }
+  if (header->nlmsg_type == RTM_NEWADDR)
+    g_ptr_array_add(addresses, g_strdup(buffer));
+}
+
+// Main loop callback: apply link and address changes
+static gboolean on_network_event(gint fd, GIOCondition condition,
+                                 gpointer user_data) {
+  (void)condition;
+  (void)user_data;
+
+  char buffer[16384]
+      __attribute__((aligned(__alignof__(struct nlmsghdr))));
+  ssize_t received;
+  while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    int length = (int)received;
+    for (struct nlmsghdr *header = (struct nlmsghdr *)buffer;
+         NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+      switch (header->nlmsg_type) {
+      case RTM_NEWLINK:
+      case RTM_DELLINK:
+        handle_link_message(header);
+        break;
+      case RTM_NEWADDR:
+      case RTM_DELADDR:
+        handle_address_message(header);
+        break;
+      case NLMSG_DONE:
+        // Only one dump can run at a time on a socket
+        if (!network_data->addresses_requested) {
+          network_data->addresses_requested = TRUE;
+          request_network_dump(RTM_GETADDR);
+        }
+        break;
       }
+    }
+  }
 
-      g_free(day);
-      g_free(month);
-      g_free(day_num);
+  update_network_items();
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean read_net_counter(const char *name, const char *counter,
+                                 guint64 *value) {
+  gchar *path =
+      g_strdup_printf("/sys/class/net/%s/statistics/%s", name, counter);
+  gchar *contents = NULL;
+  gboolean ok = g_file_get_contents(path, &contents, NULL, NULL);
+  if (ok)
+    *value = g_ascii_strtoull(contents, NULL, 10);
+  g_free(contents);
+  g_free(path);
+  return ok;
+}
+
+// Timer: sample byte counters of the interfaces that are up
+static gboolean on_network_sample(gpointer user_data) {
+  (void)user_data;
+  gint64 now = g_get_monotonic_time();
+  double elapsed = (now - network_data->sample_time) / (double)G_USEC_PER_SEC;
+  gboolean first = network_data->sample_time == 0;
+  network_data->sample_time = now;
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, network_data->interfaces);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    NetInterface *iface = value;
+    guint64 rx, tx;
+    if (!iface->up || iface->name == NULL ||
+        !read_net_counter(iface->name, "rx_bytes", &rx) ||
+        !read_net_counter(iface->name, "tx_bytes", &tx))
+      continue;
+
+    // Counters reset when an interface is recreated
+    if (!first && elapsed > 0 && rx >= iface->rx_bytes &&
+        tx >= iface->tx_bytes && iface->rx_bytes > 0) {
+      iface->rx_rate = (rx - iface->rx_bytes) / elapsed;
+      iface->tx_rate = (tx - iface->tx_bytes) / elapsed;
     }
+    iface->rx_bytes = rx;
+    iface->tx_bytes = tx;
   }
 
-  // Mark thread as no longer running
-  g_mutex_lock(&ddata->mutex);
-  ddata->thread_running = FALSE;
-  g_cond_signal(&ddata->cond);
-  g_mutex_unlock(&ddata->mutex);
+  update_network_items();
+  return G_SOURCE_CONTINUE;
+}
 
-  return NULL;
+// Open the rtnetlink socket once for all "<network>" items
+static void start_network(void) {
+  if (network_data != NULL)
+    return;
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_ROUTE);
+  struct sockaddr_nl address = {
+      .nl_family = AF_NETLINK,
+      .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR};
+  if (fd < 0 ||
+      bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    g_printerr("Failed to open rtnetlink socket: %s\n", g_strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  network_data = g_new0(NetworkData, 1);
+  network_data->fd = fd;
+  network_data->interfaces = g_hash_table_new_full(
+      g_direct_hash, g_direct_equal, NULL, free_net_interface);
+  network_data->source_id = g_unix_fd_add(fd, G_IO_IN, on_network_event, NULL);
+  network_data->timer_id =
+      g_timeout_add(NETWORK_SAMPLE_INTERVAL, on_network_sample, NULL);
+  request_network_dump(RTM_GETLINK);
+}
+
+static void stop_network(void) {
+  if (network_data == NULL)
+    return;
+
+  g_source_remove(network_data->source_id);
+  g_source_remove(network_data->timer_id);
+  close(network_data->fd);
+  g_hash_table_destroy(network_data->interfaces);
+  g_free(network_data);
+  network_data = NULL;
 }
 
 // Cleanup function to free allocated resources
 // This function is idempotent and can be called multiple times safely
 static void cleanup_resources(void) {
+  stop_module_client();
+  stop_module_server();
+  stop_profile_checks();
+  cleanup_refresh_signals();
+  cleanup_module_triggers();
+  stop_mpris();
+  stop_network();
+
   // Stop all worker threads and free resources
   if (bar_items_data != NULL) {
     for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
@@ -620,6 +6233,18 @@ static void cleanup_resources(void) {
         g_thread_join(thread);
       }
 
+      g_free(item_data->id);
+      item_data->id = NULL;
+
+      // The worker has stopped, so its shell can go
+      if (item_data->shell != NULL) {
+        stop_shell_coprocess(item_data->shell);
+        if (item_data->shell->buffer != NULL)
+          g_string_free(item_data->shell->buffer, TRUE);
+        g_free(item_data->shell);
+        item_data->shell = NULL;
+      }
+
       // Clean up mutex and condition variable
       // Only clear if thread was actually created (mutex/cond were initialized)
       if (item_data->command != NULL &&
@@ -638,6 +6263,16 @@ static void cleanup_resources(void) {
     bar_items_data = NULL;
   }
 
+  if (char_width_cache != NULL) {
+    g_hash_table_destroy(char_width_cache);
+    char_width_cache = NULL;
+  }
+
+  if (ansi_text_cache != NULL) {
+    g_hash_table_destroy(ansi_text_cache);
+    ansi_text_cache = NULL;
+  }
+
   // Cleanup weather thread
   if (weather_data != NULL) {
     g_mutex_lock(&weather_data->mutex);
@@ -687,6 +6322,47 @@ static void cleanup_resources(void) {
     weather_data = NULL;
   }
 
+  stop_bar_theme();
+
+  if (background_window != NULL) {
+    g_signal_handlers_disconnect_by_func(
+        gdk_display_get_monitors(gdk_display_get_default()),
+        on_background_outputs_changed, NULL);
+    unwatch_output(&background_output);
+    background_window = NULL;
+    cached_wallpaper_picture = NULL;
+  }
+
+  // Cleanup slideshow thread
+  if (slideshow_data != NULL) {
+    if (slideshow_data->timeout_id != 0) {
+      g_source_remove(slideshow_data->timeout_id);
+      slideshow_data->timeout_id = 0;
+    }
+
+    g_mutex_lock(&slideshow_data->mutex);
+    GThread *thread = slideshow_data->thread;
+    if (thread != NULL) {
+      slideshow_data->should_stop = TRUE;
+      g_cond_signal(&slideshow_data->cond);
+      slideshow_data->thread = NULL;
+    }
+    g_mutex_unlock(&slideshow_data->mutex);
+
+    // The worker only checks should_stop between decodes, so this may wait
+    // for one image to finish
+    if (thread != NULL)
+      g_thread_join(thread);
+
+    g_cond_clear(&slideshow_data->cond);
+    g_mutex_clear(&slideshow_data->mutex);
+    g_queue_free_full(slideshow_data->ready, g_object_unref);
+    g_strfreev(slideshow_data->paths);
+
+    g_free(slideshow_data);
+    slideshow_data = NULL;
+  }
+
   // Cleanup date thread
   if (date_data != NULL) {
     g_mutex_lock(&date_data->mutex);
@@ -735,10 +6411,111 @@ static void cleanup_resources(void) {
       g_free(date_data->previous_day_number);
       date_data->previous_day_number = NULL;
     }
+    if (date_data->previous_agenda != NULL) {
+      g_free(date_data->previous_agenda);
+      date_data->previous_agenda = NULL;
+    }
 
     g_free(date_data);
     date_data = NULL;
   }
+
+  g_mutex_lock(&extract_regex_lock);
+  if (extract_regex_cache != NULL) {
+    g_hash_table_destroy(extract_regex_cache);
+    extract_regex_cache = NULL;
+  }
+  g_mutex_unlock(&extract_regex_lock);
+
+  // Workers are gone, so nobody can be waiting on a cache entry
+  g_mutex_lock(&command_cache_lock);
+  if (command_cache != NULL) {
+    g_hash_table_destroy(command_cache);
+    command_cache = NULL;
+  }
+  g_mutex_unlock(&command_cache_lock);
+}
+
+// Allocate bar_items_data from the config; widgets are attached by the caller
+static void init_bar_items(void) {
+  bar_items_data = g_malloc0(sizeof(BarItemData) * BAR_ITEMS_COUNT);
+
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    const BarItem *item = &BAR_ITEMS[i];
+    BarItemData *item_data = &bar_items_data[i];
+    item_data->id = g_strdup_printf("bar.%zu", i);
+    item_data->command = item->command;
+    item_data->interval = item->interval;
+    item_data->signal = item->signal;
+    item_data->width_policy = item->width_policy;
+    item_data->width_chars = item->width_chars;
+    // A fixed width needs a width to fix; without one the text decides
+    if (item->width_policy == BAR_WIDTH_FIXED && item->width_chars <= 0)
+      item_data->width_policy = BAR_WIDTH_NATURAL;
+    item_data->nice = item->nice;
+    item_data->priority = item->priority;
+    item_data->cpu_budget =
+        item->cpu_budget != 0 ? item->cpu_budget : MODULE_CPU_BUDGET;
+    item_data->extract = &item->extract;
+    item_data->effective_interval = item->interval;
+    item_data->stats = &bar_module_stats[i];
+    bar_module_stats[i].name = item->command;
+    if (item->shell)
+      item_data->shell = g_new0(ShellCoprocess, 1);
+  }
+}
+
+// Initialize thread state for a (non-separator) bar item and start polling it
+static void start_bar_item(BarItemData *item_data, size_t i) {
+  // Initialize thread-related fields
+  item_data->should_stop = FALSE;
+  item_data->thread_running = FALSE;
+  item_data->refresh_requested = FALSE;
+  item_data->previous_output = NULL;
+  item_data->thread = NULL;
+  g_mutex_init(&item_data->mutex);
+  g_cond_init(&item_data->cond);
+
+  // A frontend only shows what the backend publishes
+  if (connect_mode)
+    return;
+
+  // Native modules update from the main loop and need no worker
+  if (strcmp(item_data->command, MODULE_MPRIS) == 0) {
+    start_mpris();
+    return;
+  }
+  if (strcmp(item_data->command, MODULE_NETWORK) == 0) {
+    start_network();
+    return;
+  }
+
+  // Spawn worker thread for this module if it polls or has a refresh
+  // signal or event trigger. Ensure thread is only created once
+  if ((item_data->interval > 0 || item_data->signal > 0 ||
+       module_has_triggers(&BAR_ITEMS[i])) &&
+      item_data->thread == NULL) {
+    GError *error = NULL;
+    item_data->thread = new_worker_thread(
+        "module-worker", module_worker_thread, item_data, &error);
+
+    if (item_data->thread == NULL) {
+      g_printerr("Failed to create thread for module %zu: %s\n", i,
+                 error ? error->message : "Unknown error");
+      if (error)
+        g_error_free(error);
+    }
+  } else {
+    // No interval - execute once immediately
+    gchar *output = run_module_command(item_data, FALSE);
+    if (output != NULL) {
+      if (engine_only)
+        emit_module_update(item_data->id, output);
+      else
+        set_bar_label_text(item_data->widget, output);
+      g_free(output);
+    }
+  }
 }
 
 static void create_menu_bar(GtkApplication *app) {
@@ -831,14 +6608,12 @@ static void create_menu_bar(GtkApplication *app) {
   g_object_unref(css_provider);
 
   // Allocate memory for item data
-  bar_items_data = g_malloc0(sizeof(BarItemData) * BAR_ITEMS_COUNT);
+  init_bar_items();
 
   // Add content to bar from config
   for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
     const BarItem *item = &BAR_ITEMS[i];
     BarItemData *item_data = &bar_items_data[i];
-    item_data->command = item->command;
-    item_data->interval = item->interval;
 
     if (strcmp(item->command, "<separator>") == 0) {
       // Create separator that expands
@@ -853,76 +6628,105 @@ static void create_menu_bar(GtkApplication *app) {
       gtk_widget_set_halign(label, GTK_ALIGN_START);
       item_data->widget = label;
       gtk_box_append(GTK_BOX(bar_box), label);
-
-      // Initialize thread-related fields
-      item_data->should_stop = FALSE;
-      item_data->thread_running = FALSE;
-      item_data->previous_output = NULL;
-      item_data->thread = NULL;
-      g_mutex_init(&item_data->mutex);
-      g_cond_init(&item_data->cond);
-
-      // Spawn worker thread for this module if interval > 0
-      // Ensure thread is only created once
-      if (item->interval > 0 && item_data->thread == NULL) {
-        GError *error = NULL;
-        item_data->thread = g_thread_try_new(
-            "module-worker", module_worker_thread, item_data, &error);
-
-        if (item_data->thread == NULL) {
-          g_printerr("Failed to create thread for module %zu: %s\n", i,
-                     error ? error->message : "Unknown error");
-          if (error)
-            g_error_free(error);
-        }
-      } else {
-        // No interval - execute once immediately
-        gchar *output = execute_command(item_data->command);
-        if (output != NULL) {
-          gtk_label_set_text(GTK_LABEL(label), output);
-          g_free(output);
-        }
+      g_object_set_data(G_OBJECT(label), "bar-item", item_data);
+
+      // Labels with a character limit ellipsize instead of growing the bar
+      if ((item->width_policy == BAR_WIDTH_FIXED ||
+           item->width_policy == BAR_WIDTH_MAX) &&
+          item->width_chars > 0) {
+        gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_END);
+        gtk_label_set_max_width_chars(GTK_LABEL(label), item->width_chars);
       }
+
+      if (item->detail_command != NULL)
+        attach_detail_command(label, item->detail_command);
+
+      register_module_widget(item_data->id, label);
+      start_bar_item(item_data, i);
     }
   }
 
+  // Let scripts trigger immediate refreshes with SIGRTMIN+N, and file
+  // changes or uevents refresh the items that watch them
+  if (connect_mode) {
+    connect_module_server(NULL);
+  } else {
+    setup_refresh_signals();
+    setup_module_triggers();
+    start_profile_checks();
+  }
+
   gtk_box_append(GTK_BOX(outer_box), bar_box);
   gtk_window_set_child(GTK_WINDOW(menu_window), outer_box);
 
+  attach_window_stats(menu_window, &bar_window_stats);
   gtk_widget_set_visible(menu_window, TRUE);
+  watch_bar_output(menu_window);
 }
 
-static void create_day_text(GtkApplication *app) {
-  // Create day text window
-  GtkWidget *day_window = gtk_application_window_new(app);
-  gtk_layer_init_for_window(GTK_WINDOW(day_window));
-  gtk_layer_set_namespace(GTK_WINDOW(day_window), "day-text");
-  gtk_layer_set_layer(GTK_WINDOW(day_window), GTK_LAYER_SHELL_LAYER_BACKGROUND);
+// Start the date worker; widgets may be NULL when running headless
+static void start_date_worker(GtkWidget *day_widget, GtkWidget *month_widget,
+                              GtkWidget *day_number_widget,
+                              GtkWidget *agenda_widget) {
+  // Initialize date data structure
+  date_data = g_malloc0(sizeof(DateData));
+  date_data->day_widget = day_widget;
+  date_data->month_widget = month_widget;
+  date_data->day_number_widget = day_number_widget;
+  date_data->agenda_widget = agenda_widget;
+  date_data->should_stop = FALSE;
+  date_data->thread_running = FALSE;
+  date_data->previous_day = NULL;
+  date_data->previous_month = NULL;
+  date_data->previous_day_number = NULL;
+  date_data->previous_agenda = NULL;
+  date_data->thread = NULL;
+  g_mutex_init(&date_data->mutex);
+  g_cond_init(&date_data->cond);
 
-  // Disable keyboard interactivity so it stays behind other layer shell windows
-  gtk_layer_set_keyboard_mode(GTK_WINDOW(day_window),
-                              GTK_LAYER_SHELL_KEYBOARD_MODE_NONE);
+  // Spawn date worker thread
+  GError *error = NULL;
+  date_data->thread =
+      new_worker_thread("date-worker", date_worker_thread, date_data, &error);
 
-  // Anchor to all edges to cover the entire screen
-  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_TOP, TRUE);
-  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_BOTTOM,
-                       TRUE);
-  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_LEFT, TRUE);
-  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_RIGHT,
-                       TRUE);
+  if (date_data->thread == NULL) {
+    g_printerr("Failed to create date thread: %s\n",
+               error ? error->message : "Unknown error");
+    if (error)
+      g_error_free(error);
+  }
+}
 
-  // Ensure no margins - should cover entire screen
-  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_TOP, 0);
-  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_BOTTOM, 0);
-  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_LEFT, 0);
-  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_RIGHT, 0);
+// Start the weather worker; widgets may be NULL when running headless
+static void start_weather_worker(GtkWidget *emoji_widget,
+                                 GtkWidget *temp_widget) {
+  // Initialize weather data structure
+  weather_data = g_malloc0(sizeof(WeatherData));
+  weather_data->emoji_widget = emoji_widget;
+  weather_data->temp_widget = temp_widget;
+  weather_data->should_stop = FALSE;
+  weather_data->thread_running = FALSE;
+  weather_data->previous_emoji = NULL;
+  weather_data->previous_temp = NULL;
+  weather_data->thread = NULL;
+  g_mutex_init(&weather_data->mutex);
+  g_cond_init(&weather_data->cond);
 
-  // Set exclusive zone to -1 (above background which is -2)
-  gtk_layer_set_exclusive_zone(GTK_WINDOW(day_window), -1);
+  // Spawn weather worker thread
+  GError *error = NULL;
+  weather_data->thread = new_worker_thread(
+      "weather-worker", weather_worker_thread, weather_data, &error);
 
-  // Make window background transparent
-  gtk_widget_add_css_class(GTK_WIDGET(day_window), "transparent-day-window");
+  if (weather_data->thread == NULL) {
+    g_printerr("Failed to create weather thread: %s\n",
+               error ? error->message : "Unknown error");
+    if (error)
+      g_error_free(error);
+  }
+}
 
+// Build the date and weather dashboard and start its workers
+static GtkWidget *create_dashboard(void) {
   // Create vertical box to stack month+day and day name
   GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
   gtk_widget_set_halign(vbox, GTK_ALIGN_CENTER);
@@ -988,6 +6792,7 @@ static void create_day_text(GtkApplication *app) {
 
   // Add weather box to weather container
   gtk_box_append(GTK_BOX(weather_container), weather_box);
+  attach_detail_command(weather_box, WEATHER_DETAIL_COMMAND);
 
   // Create CSS for the day text, month text, and day number text
   GtkCssProvider *css_provider = gtk_css_provider_new();
@@ -1051,6 +6856,12 @@ static void create_day_text(GtkApplication *app) {
       "  margin-right: %dpx;"
       "  margin-bottom: %dpx;"
       "  margin-left: %dpx;"
+      "}"
+      ".agenda-text {"
+      "  font-family: %s;"
+      "  font-size: %dpt;"
+      "  color: rgba(255, 255, 255, 1.0);"
+      "  background-color: transparent;"
       "}",
       DAY_TEXT_FONT, DAY_TEXT_SIZE, DAY_TEXT_LETTER_SPACING,
       DAY_TEXT_MARGIN_TOP, DAY_TEXT_MARGIN_RIGHT, DAY_TEXT_MARGIN_BOTTOM,
@@ -1065,7 +6876,7 @@ static void create_day_text(GtkApplication *app) {
       WEATHER_EMOJI_MARGIN_BOTTOM, WEATHER_EMOJI_MARGIN_LEFT, WEATHER_TEMP_FONT,
       WEATHER_TEMP_SIZE, WEATHER_TEMP_LETTER_SPACING, WEATHER_TEMP_MARGIN_TOP,
       WEATHER_TEMP_MARGIN_RIGHT, WEATHER_TEMP_MARGIN_BOTTOM,
-      WEATHER_TEMP_MARGIN_LEFT);
+      WEATHER_TEMP_MARGIN_LEFT, AGENDA_FONT, AGENDA_TEXT_SIZE);
 
   gtk_css_provider_load_from_string(css_provider, css);
   gtk_style_context_add_provider_for_display(
@@ -1091,63 +6902,188 @@ static void create_day_text(GtkApplication *app) {
   // Append weather container to main vertical box
   gtk_box_append(GTK_BOX(vbox), weather_container);
 
-  // Initialize date data structure
-  date_data = g_malloc0(sizeof(DateData));
-  date_data->day_widget = day_label;
-  date_data->month_widget = month_label;
-  date_data->day_number_widget = day_number_label;
-  date_data->should_stop = FALSE;
-  date_data->thread_running = FALSE;
-  date_data->previous_day = NULL;
-  date_data->previous_month = NULL;
-  date_data->previous_day_number = NULL;
-  date_data->thread = NULL;
-  g_mutex_init(&date_data->mutex);
-  g_cond_init(&date_data->cond);
+  // Upcoming calendar events below the weather, right-aligned with it
+  GtkWidget *agenda_label = NULL;
+  const char *agenda_files = AGENDA_FILES;
+  if (agenda_files != NULL) {
+    agenda_label = gtk_label_new("");
+    gtk_widget_set_halign(agenda_label, GTK_ALIGN_END);
+    gtk_label_set_justify(GTK_LABEL(agenda_label), GTK_JUSTIFY_RIGHT);
+    gtk_widget_add_css_class(agenda_label, "agenda-text");
+    gtk_box_append(GTK_BOX(vbox), agenda_label);
+    register_module_widget("date.agenda", agenda_label);
+  }
 
-  // Spawn date worker thread
-  GError *error = NULL;
-  date_data->thread =
-      g_thread_try_new("date-worker", date_worker_thread, date_data, &error);
+  register_module_widget("date.day", day_label);
+  register_module_widget("date.month", month_label);
+  register_module_widget("date.day_number", day_number_label);
+  register_module_widget("weather.emoji", weather_emoji_label);
+  register_module_widget("weather.temp", weather_temp_label);
 
-  if (date_data->thread == NULL) {
-    g_printerr("Failed to create date thread: %s\n",
-               error ? error->message : "Unknown error");
-    if (error)
-      g_error_free(error);
+  if (!connect_mode) {
+    start_date_worker(day_label, month_label, day_number_label,
+                      agenda_label);
+    start_weather_worker(weather_emoji_label, weather_temp_label);
   }
 
-  // Initialize weather data structure
-  weather_data = g_malloc0(sizeof(WeatherData));
-  weather_data->emoji_widget = weather_emoji_label;
-  weather_data->temp_widget = weather_temp_label;
-  weather_data->should_stop = FALSE;
-  weather_data->thread_running = FALSE;
-  weather_data->previous_emoji = NULL;
-  weather_data->previous_temp = NULL;
-  weather_data->thread = NULL;
-  g_mutex_init(&weather_data->mutex);
-  g_cond_init(&weather_data->cond);
+  return vbox;
+}
 
-  // Spawn weather worker thread
-  error = NULL;
-  weather_data->thread = g_thread_try_new(
-      "weather-worker", weather_worker_thread, weather_data, &error);
+static void create_day_text(GtkApplication *app) {
+  // Create day text window
+  GtkWidget *day_window = gtk_application_window_new(app);
+  gtk_layer_init_for_window(GTK_WINDOW(day_window));
+  gtk_layer_set_namespace(GTK_WINDOW(day_window), "day-text");
+  gtk_layer_set_layer(GTK_WINDOW(day_window), GTK_LAYER_SHELL_LAYER_BACKGROUND);
 
-  if (weather_data->thread == NULL) {
-    g_printerr("Failed to create weather thread: %s\n",
+  // Disable keyboard interactivity so it stays behind other layer shell windows
+  gtk_layer_set_keyboard_mode(GTK_WINDOW(day_window),
+                              GTK_LAYER_SHELL_KEYBOARD_MODE_NONE);
+
+  // Anchor to all edges to cover the entire screen
+  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_TOP, TRUE);
+  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_BOTTOM,
+                       TRUE);
+  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_LEFT, TRUE);
+  gtk_layer_set_anchor(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_RIGHT,
+                       TRUE);
+
+  // Ensure no margins - should cover entire screen
+  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_TOP, 0);
+  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_BOTTOM, 0);
+  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_LEFT, 0);
+  gtk_layer_set_margin(GTK_WINDOW(day_window), GTK_LAYER_SHELL_EDGE_RIGHT, 0);
+
+  // Set exclusive zone to -1 (above background which is -2)
+  gtk_layer_set_exclusive_zone(GTK_WINDOW(day_window), -1);
+
+  // Make window background transparent
+  gtk_widget_add_css_class(GTK_WIDGET(day_window), "transparent-day-window");
+
+  gtk_window_set_child(GTK_WINDOW(day_window), create_dashboard());
+  attach_window_stats(day_window, &day_text_window_stats);
+  gtk_widget_set_visible(day_window, TRUE);
+}
+
+// Text the dashboard and bar are most likely to draw, per font
+typedef struct {
+  const char *family;
+  int size;
+  const char *text;
+} FontWarmupSet;
+
+static const FontWarmupSet font_warmup_sets[] = {
+    {DAY_TEXT_FONT, DAY_TEXT_SIZE,
+     "MONDAY TUESDAY WEDNESDAY THURSDAY FRIDAY SATURDAY SUNDAY"},
+    {MONTH_TEXT_FONT, MONTH_TEXT_SIZE,
+     "JANUARY FEBRUARY MARCH APRIL MAY JUNE JULY AUGUST SEPTEMBER OCTOBER "
+     "NOVEMBER DECEMBER"},
+    {DAY_NUMBER_TEXT_FONT, DAY_NUMBER_TEXT_SIZE, "0123456789"},
+    {WEATHER_EMOJI_FONT, WEATHER_EMOJI_SIZE,
+     "☀️🌤️⛅️🌥️☁️🌦️🌧️⛈️🌩️🌨️❄️🌫️✨"},
+    {WEATHER_TEMP_FONT, WEATHER_TEMP_SIZE, "+-0123456789°CF"},
+    {BAR_FONT, BAR_TEXT_SIZE,
+     "ABCDEFGHIJKLMNOPQRSTUVWXYZ abcdefghijklmnopqrstuvwxyz 0123456789 "
+     "%:.,-+/|()[]"},
+};
+
+// Resolve the configured fonts and render their likely glyphs once. Pango
+// font maps are per thread, so this uses a private one whose font and
+// shaping caches are thrown away afterwards; what carries over to GTK's font
+// map is fontconfig's process-wide state (configuration, cache files and
+// match results) and the font files in the page cache.
+static gpointer font_warmup_thread(gpointer user_data) {
+  (void)user_data;
+  gint64 start_time = g_get_monotonic_time();
+  TRACE_BEGIN("font_warmup", NULL);
+
+  PangoFontMap *font_map = pango_cairo_font_map_new();
+  PangoContext *context = pango_font_map_create_context(font_map);
+  PangoLayout *layout = pango_layout_new(context);
+
+  for (size_t i = 0; i < G_N_ELEMENTS(font_warmup_sets); i++) {
+    const FontWarmupSet *set = &font_warmup_sets[i];
+    PangoFontDescription *desc = pango_font_description_new();
+    pango_font_description_set_family(desc, set->family);
+    pango_font_description_set_size(desc, set->size * PANGO_SCALE);
+    pango_layout_set_font_description(layout, desc);
+    pango_layout_set_text(layout, set->text, -1);
+
+    // Measuring shapes the text; drawing it rasterizes the glyphs
+    PangoRectangle logical;
+    pango_layout_get_pixel_extents(layout, NULL, &logical);
+    cairo_surface_t *surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, MAX(logical.width, 1), MAX(logical.height, 1));
+    cairo_t *cr = cairo_create(surface);
+    pango_cairo_update_layout(cr, layout);
+    pango_cairo_show_layout(cr, layout);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    pango_font_description_free(desc);
+  }
+
+  g_object_unref(layout);
+  g_object_unref(context);
+  g_object_unref(font_map);
+
+  TRACE_END("font_warmup");
+  g_mutex_lock(&font_warmup.mutex);
+  font_warmup.duration = g_get_monotonic_time() - start_time;
+  font_warmup.done = TRUE;
+  g_cond_signal(&font_warmup.cond);
+  g_mutex_unlock(&font_warmup.mutex);
+  return NULL;
+}
+
+static void start_font_warmup(void) {
+  GError *error = NULL;
+  font_warmup.thread =
+      g_thread_try_new("font-warmup", font_warmup_thread, NULL, &error);
+
+  if (font_warmup.thread == NULL) {
+    g_printerr("Failed to create font warm-up thread: %s\n",
                error ? error->message : "Unknown error");
     if (error)
       g_error_free(error);
   }
+}
+
+// Give the warm-up up to FONT_WARMUP_TIMEOUT to finish before any text is
+// mapped. The timeout counts from the first call, so later callers never
+// wait longer in total.
+static void wait_for_font_warmup(void) {
+  if (font_warmup.thread == NULL)
+    return;
+
+  gint64 start_time = g_get_monotonic_time();
+  if (font_warmup.deadline == 0)
+    font_warmup.deadline = start_time + FONT_WARMUP_TIMEOUT * 1000;
+
+  g_mutex_lock(&font_warmup.mutex);
+  while (!font_warmup.done) {
+    if (!g_cond_wait_until(&font_warmup.cond, &font_warmup.mutex,
+                           font_warmup.deadline))
+      break;
+  }
+  g_mutex_unlock(&font_warmup.mutex);
 
-  gtk_window_set_child(GTK_WINDOW(day_window), vbox);
-  gtk_widget_set_visible(day_window, TRUE);
+  font_warmup.waited += g_get_monotonic_time() - start_time;
+}
+
+static void stop_font_warmup(void) {
+  if (font_warmup.thread == NULL)
+    return;
+
+  g_thread_join(font_warmup.thread);
+  font_warmup.thread = NULL;
 }
 
 static void activate(GtkApplication *app) {
   // Create background window
+  TRACE_BEGIN("create_window", "background");
+  USDT(window_create_start, "background");
   GtkWidget *window = gtk_application_window_new(app);
+  background_window = window;
   gtk_layer_init_for_window(GTK_WINDOW(window));
   gtk_layer_set_namespace(GTK_WINDOW(window), "background");
   gtk_layer_set_layer(GTK_WINDOW(window), GTK_LAYER_SHELL_LAYER_BACKGROUND);
@@ -1172,33 +7108,147 @@ static void activate(GtkApplication *app) {
   // and doesn't respect exclusive zones from other windows
   gtk_layer_set_exclusive_zone(GTK_WINDOW(window), -2);
 
-  // Set background image if provided
-  if (background_image_path != NULL) {
-    GtkWidget *picture = gtk_picture_new_for_filename(background_image_path);
-    if (picture != NULL) {
-      gtk_picture_set_content_fit(GTK_PICTURE(picture), GTK_CONTENT_FIT_FILL);
-      gtk_window_set_child(GTK_WINDOW(window), picture);
+  // Rotate wallpapers from a directory or playlist, otherwise set the
+  // background image if provided
+  GtkWidget *picture = NULL;
+  if (background_dir_path != NULL || background_playlist_path != NULL ||
+      background_image_path != NULL) {
+    picture = gtk_picture_new();
+    gtk_picture_set_content_fit(GTK_PICTURE(picture), GTK_CONTENT_FIT_FILL);
+
+    // A cached single wallpaper is mapped right away; anything that needs
+    // decoding goes through the slideshow worker so the main loop never
+    // stalls on it
+    GdkTexture *texture = NULL;
+    int width = -1, height = -1;
+    if (background_dir_path == NULL && background_playlist_path == NULL) {
+      get_output_size(&width, &height);
+      texture = load_cached_wallpaper(background_image_path, width, height);
+    }
+
+    if (texture != NULL) {
+      show_wallpaper(picture, texture);
+      g_object_unref(texture);
+      cached_wallpaper_picture = picture;
+      cached_wallpaper_width = width;
+      cached_wallpaper_height = height;
     } else {
-      g_printerr("Failed to load image: %s\n", background_image_path);
+      start_slideshow(picture);
     }
   }
 
+  if (DASHBOARD_IN_BACKGROUND) {
+    // Draw the dashboard over the wallpaper in the same surface instead of
+    // stacking a second full-screen background surface on top of it
+    GtkWidget *overlay = gtk_overlay_new();
+    gtk_overlay_set_child(GTK_OVERLAY(overlay), picture);
+    wait_for_font_warmup();
+    gtk_overlay_add_overlay(GTK_OVERLAY(overlay), create_dashboard());
+    gtk_window_set_child(GTK_WINDOW(window), overlay);
+  } else if (picture != NULL) {
+    gtk_window_set_child(GTK_WINDOW(window), picture);
+  }
+
+  attach_window_stats(window, &background_window_stats);
   gtk_widget_set_visible(window, TRUE);
+  watch_background_output(window);
+  USDT(window_create_end, "background");
+  TRACE_END("create_window");
+
+  // Text windows map only once the fonts are warm (or the timeout passed)
+  wait_for_font_warmup();
 
   // Create day text window (on layer -1, above background)
-  create_day_text(app);
+  if (!DASHBOARD_IN_BACKGROUND) {
+    TRACE_BEGIN("create_window", "day-text");
+    USDT(window_create_start, "day-text");
+    create_day_text(app);
+    USDT(window_create_end, "day-text");
+    TRACE_END("create_window");
+  }
 
   // Create menu bar window
+  TRACE_BEGIN("create_window", "bar");
+  USDT(window_create_start, "bar");
   create_menu_bar(app);
+  USDT(window_create_end, "bar");
+  TRACE_END("create_window");
+
+  g_idle_add(on_startup_settled, NULL);
+}
+
+static gboolean on_headless_quit_signal(gpointer user_data) {
+  g_main_loop_quit((GMainLoop *)user_data);
+  return G_SOURCE_CONTINUE;
+}
+
+// Run the module workers without any windows until SIGINT or SIGTERM,
+// printing every change to stdout as a JSON line (--headless) or
+// publishing it to frontends on the socket (--serve)
+static int run_headless(void) {
+  if (serve_mode && !start_module_server())
+    return 1;
+
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  guint sigint_id = g_unix_signal_add(SIGINT, on_headless_quit_signal, loop);
+  guint sigterm_id = g_unix_signal_add(SIGTERM, on_headless_quit_signal, loop);
+
+  init_bar_items();
+  for (size_t i = 0; i < BAR_ITEMS_COUNT; i++) {
+    if (strcmp(bar_items_data[i].command, "<separator>") != 0)
+      start_bar_item(&bar_items_data[i], i);
+  }
+  setup_refresh_signals();
+  setup_module_triggers();
+  start_profile_checks();
+
+  start_date_worker(NULL, NULL, NULL, NULL);
+  start_weather_worker(NULL, NULL);
+  g_idle_add(on_startup_settled, NULL);
+
+  g_main_loop_run(loop);
+
+  g_source_remove(sigint_id);
+  g_source_remove(sigterm_id);
+  cleanup_resources();
+  g_main_loop_unref(loop);
+  return 0;
 }
 
 int main(int argc, char **argv) {
+  startup_time = g_get_monotonic_time();
+
   // Parse command line arguments
   GOptionContext *context;
-  GOptionEntry entries[] = {{"background-image", 'b', 0, G_OPTION_ARG_STRING,
-                             &background_image_path, "Path to background image",
-                             "PATH"},
-                            {NULL}};
+  GOptionEntry entries[] = {
+      {"background-image", 'b', 0, G_OPTION_ARG_STRING, &background_image_path,
+       "Path to background image", "PATH"},
+      {"background-dir", 'd', 0, G_OPTION_ARG_STRING, &background_dir_path,
+       "Rotate through the images in a directory", "DIR"},
+      {"background-playlist", 'p', 0, G_OPTION_ARG_STRING,
+       &background_playlist_path,
+       "Rotate through the images listed in a file, one per line", "FILE"},
+      {"slideshow-interval", 'i', 0, G_OPTION_ARG_INT, &slideshow_interval,
+       "Seconds between wallpapers in a slideshow", "SECONDS"},
+      {"stats", 's', 0, G_OPTION_ARG_NONE, &print_stats_on_exit,
+       "Print runtime statistics on exit (also on SIGUSR1)", NULL},
+      {"trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path,
+       "Record a Chrome trace (JSON) of workers and UI updates", "FILE"},
+      {"headless", 'H', 0, G_OPTION_ARG_NONE, &headless_mode,
+       "Run without windows, printing module updates to stdout as JSON lines",
+       NULL},
+      {"serve", 0, 0, G_OPTION_ARG_NONE, &serve_mode,
+       "Run without windows, publishing module updates on a Unix socket",
+       NULL},
+      {"connect", 0, 0, G_OPTION_ARG_NONE, &connect_mode,
+       "Show module updates from a --serve backend instead of polling", NULL},
+      {"socket", 0, 0, G_OPTION_ARG_FILENAME, &socket_path,
+       "Socket used by --serve and --connect", "PATH"},
+      {"low-memory", 'm', 0, G_OPTION_ARG_NONE, &low_memory_mode,
+       "Use fewer malloc arenas and smaller stacks, and trim the heap", NULL},
+      {"no-font-warmup", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE,
+       &font_warmup_enabled, "Skip the font warm-up (FONT_WARMUP)", NULL},
+      {NULL}};
 
   context = g_option_context_new("- Desktop background layer shell");
   g_option_context_add_main_entries(context, entries, NULL);
@@ -1213,6 +7263,36 @@ int main(int argc, char **argv) {
 
   g_option_context_free(context);
 
+  if (connect_mode && (headless_mode || serve_mode)) {
+    g_printerr("--connect cannot be combined with --headless or --serve\n");
+    return 1;
+  }
+  engine_only = headless_mode || serve_mode;
+  apply_low_memory_mode();
+
+  if (trace_path != NULL)
+    start_tracing();
+
+  // Warm up fonts while GTK connects to the display and the background
+  // window is created
+  if (font_warmup_enabled && !engine_only)
+    start_font_warmup();
+
+  // Dump runtime statistics on demand
+  g_unix_signal_add(SIGUSR1, on_stats_signal, NULL);
+
+  if (engine_only) {
+    int status = run_headless();
+    stop_tracing();
+    if (print_stats_on_exit)
+      print_runtime_stats();
+    g_free(background_image_path);
+    g_free(background_dir_path);
+    g_free(background_playlist_path);
+    g_free(trace_path);
+    return status;
+  }
+
   GtkApplication *app = gtk_application_new("org.example.layer-shell",
                                             G_APPLICATION_DEFAULT_FLAGS);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
@@ -1224,7 +7304,18 @@ int main(int argc, char **argv) {
 
   // Cleanup allocated resources (in case shutdown signal didn't fire)
   cleanup_resources();
+  stop_font_warmup();
+  stop_tracing();
+  if (print_stats_on_exit)
+    print_runtime_stats();
+  free_window_stats(&background_window_stats);
+  free_window_stats(&day_text_window_stats);
+  free_window_stats(&bar_window_stats);
   g_free(background_image_path);
+  g_free(background_dir_path);
+  g_free(background_playlist_path);
+  g_free(trace_path);
+  g_free(socket_path);
   g_object_unref(app);
   return status;
 }